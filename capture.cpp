@@ -0,0 +1,88 @@
+#include "capture.hpp"
+#include "timer.hpp"
+#include "config.hpp"
+
+#ifdef DLL_CAPTURE
+
+uint8_t capture_buffer[CAPTURE_BUFFER_SIZE];
+uint16_t capture_head; // next byte to write
+uint16_t capture_tail; // first byte of the oldest record
+uint16_t capture_used;
+uint16_t capture_last_flags; // flags byte of the newest record
+
+void init_capture() {
+    init_timer1();
+    capture_head = 0;
+    capture_tail = 0;
+    capture_used = 0;
+    capture_last_flags = CAPTURE_BUFFER_SIZE;
+}
+
+uint16_t capture_index(uint16_t index) {
+    return index % CAPTURE_BUFFER_SIZE;
+}
+
+void capture_byte(uint8_t byte) {
+    capture_buffer[capture_head] = byte;
+    capture_head = capture_index(capture_head + 1);
+}
+
+void capture_frame(uint8_t flags, uint8_t* frame, uint8_t frame_length) {
+    // Truncate frames larger than the whole buffer
+    if (frame_length > CAPTURE_BUFFER_SIZE - CAPTURE_HEADER_LENGTH) {
+        frame_length = CAPTURE_BUFFER_SIZE - CAPTURE_HEADER_LENGTH;
+    }
+    uint16_t record_length = CAPTURE_HEADER_LENGTH + frame_length;
+    // Overwrite the oldest records until the new one fits
+    while (CAPTURE_BUFFER_SIZE - capture_used < record_length) {
+        uint16_t oldest_length = CAPTURE_HEADER_LENGTH + capture_buffer[capture_index(capture_tail + 5)];
+        capture_tail = capture_index(capture_tail + oldest_length);
+        capture_used -= oldest_length;
+    }
+    uint32_t timestamp = get_cycles();
+    capture_byte(timestamp >> 24);
+    capture_byte(timestamp >> 16);
+    capture_byte(timestamp >> 8);
+    capture_byte(timestamp);
+    capture_last_flags = capture_head;
+    capture_byte(flags);
+    capture_byte(frame_length);
+    for (uint8_t i = 0; i < frame_length; i++) {
+        capture_byte(frame[i]);
+    }
+    capture_used += record_length;
+}
+
+// Records why the most recently captured frame was dropped
+void capture_drop(uint8_t reason) {
+    if (capture_last_flags < CAPTURE_BUFFER_SIZE) {
+        capture_buffer[capture_last_flags] = (capture_buffer[capture_last_flags] & CAPTURE_TX) | reason;
+    }
+}
+
+void put_raw_hex(uint8_t byte) {
+    const char digits[] = "0123456789ABCDEF";
+    put_ch(digits[byte >> 4]);
+    put_ch(digits[byte & 0x0F]);
+}
+
+// One record per line as raw hex, converted to pcap by capture2pcap on the host
+void dump_capture() {
+    put_str("CAPTURE BEGIN\r\n");
+    uint16_t index = capture_tail;
+    uint16_t remaining = capture_used;
+    while (remaining > 0) {
+        uint16_t record_length = CAPTURE_HEADER_LENGTH + capture_buffer[capture_index(index + 5)];
+        for (uint16_t i = 0; i < record_length; i++) {
+            put_raw_hex(capture_buffer[capture_index(index + i)]);
+            if (i == 3 or i == 4 or i == 5) {
+                put_ch(' ');
+            }
+        }
+        put_str("\r\n");
+        index = capture_index(index + record_length);
+        remaining -= record_length;
+    }
+    put_str("CAPTURE END\r\n");
+}
+#endif
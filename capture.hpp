@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+
+// Ring buffer size in bytes, oldest records are overwritten when full
+#define CAPTURE_BUFFER_SIZE 256
+
+/*
+Each record is stored as:
++-----------+-------+--------+------------------+
+| Timestamp | Flags | Length |   Stuffed frame  |
++-----------+-------+--------+------------------+
+|  4 bytes  |   1   |   1    |  Length bytes    |
++-----------+-------+--------+------------------+
+Timestamp is in CPU cycles (big endian), flags hold the direction (CAPTURE_TX)
+and the drop reason (DROP_* in dll.hpp). A frame that could not be sent at all
+is recorded as a sent frame of length 0 with its drop reason.
+*/
+#define CAPTURE_HEADER_LENGTH 6
+#define CAPTURE_TX 0x80
+
+void init_capture();
+void capture_frame(uint8_t flags, uint8_t* frame, uint8_t frame_length);
+void capture_drop(uint8_t reason);
+void dump_capture();
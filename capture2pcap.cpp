@@ -0,0 +1,103 @@
+// Host tool: converts a dump_capture() log into a pcap file for Wireshark
+//
+// Usage: capture2pcap <log> <output.pcap>
+//
+// Packets use LINKTYPE_USER0 (147) with the layout:
+// +-----------+-------------+-----------------------------------------------+
+// | Direction | Drop reason |                 Stuffed frame                 |
+// +-----------+-------------+-----------------------------------------------+
+// |  1 byte   |   1 byte    | FLAG, escaped header/packet/checksum, FLAG    |
+// +-----------+-------------+-----------------------------------------------+
+// Direction is 1 for sent and 0 for received frames, drop reasons are the
+// DROP_* values in dll.hpp
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "capture.hpp"
+
+#define LINKTYPE_USER0 147
+#define CYCLES_PER_SECOND 12000000ULL
+
+void write_uint32(FILE* file, uint32_t value) {
+    fwrite(&value, sizeof(value), 1, file);
+}
+
+void write_uint16(FILE* file, uint16_t value) {
+    fwrite(&value, sizeof(value), 1, file);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <log> <output.pcap>\n", argv[0]);
+        return 1;
+    }
+    FILE* log = fopen(argv[1], "r");
+    if (log == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    FILE* pcap = fopen(argv[2], "wb");
+    if (pcap == NULL) {
+        perror(argv[2]);
+        return 1;
+    }
+    // Global header (native byte order, microsecond timestamps)
+    write_uint32(pcap, 0xA1B2C3D4);
+    write_uint16(pcap, 2);
+    write_uint16(pcap, 4);
+    write_uint32(pcap, 0);
+    write_uint32(pcap, 0);
+    write_uint32(pcap, 65535);
+    write_uint32(pcap, LINKTYPE_USER0);
+
+    char line[1024];
+    bool in_capture = false;
+    uint64_t epoch = 0; // cycles lost to 32-bit timestamp wraparound
+    uint32_t last_timestamp = 0;
+    unsigned num_records = 0;
+    while (fgets(line, sizeof(line), log) != NULL) {
+        if (strncmp(line, "CAPTURE BEGIN", 13) == 0) {
+            in_capture = true;
+            continue;
+        }
+        if (strncmp(line, "CAPTURE END", 11) == 0) {
+            in_capture = false;
+            continue;
+        }
+        if (not in_capture) {
+            continue;
+        }
+        unsigned timestamp, flags, length;
+        int offset;
+        if (sscanf(line, "%8x %2x %2x %n", &timestamp, &flags, &length, &offset) != 3) {
+            fprintf(stderr, "Skipping malformed record: %s", line);
+            continue;
+        }
+        uint8_t packet[2 + 255];
+        packet[0] = (flags & CAPTURE_TX) ? 1 : 0;
+        packet[1] = flags & ~CAPTURE_TX;
+        unsigned num_bytes = 0;
+        for (const char* hex = line + offset; num_bytes < length and sscanf(hex, "%2hhx", &packet[2 + num_bytes]) == 1; hex += 2) {
+            num_bytes++;
+        }
+        if (num_bytes != length) {
+            fprintf(stderr, "Skipping truncated record: %s", line);
+            continue;
+        }
+        if (timestamp < last_timestamp) {
+            epoch += 1ULL << 32;
+        }
+        last_timestamp = timestamp;
+        uint64_t cycles = epoch + timestamp;
+        write_uint32(pcap, cycles / CYCLES_PER_SECOND);
+        write_uint32(pcap, cycles % CYCLES_PER_SECOND * 1000000 / CYCLES_PER_SECOND);
+        write_uint32(pcap, 2 + length);
+        write_uint32(pcap, 2 + length);
+        fwrite(packet, 1, 2 + length, pcap);
+        num_records++;
+    }
+    fclose(log);
+    fclose(pcap);
+    fprintf(stderr, "Wrote %u frames to %s\n", num_records, argv[2]);
+    return 0;
+}
@@ -10,6 +10,30 @@
 // #define DEBUG_DLL_FRAMES
 #define DEBUG_DLL_STEPS
 
+// LINK RATE NEGOTIATION
+// #define DLL_RATE_NEGOTIATION
+
+// CYCLE PROFILING (Timer1, best measured with DLL debugging off)
+// #define DLL_PROFILE
+
+// FRAME CAPTURE (ring buffer, see capture.hpp)
+#define DLL_CAPTURE
+
+// PAYLOAD COMPRESSION (LZSS, see lzss.hpp)
+// #define DLL_COMPRESSION
+
+// LINK QUALITY ESTIMATION (round trip time, error rate, adaptive fragment size)
+#define DLL_LINK_QUALITY
+
+// DUPLICATE SUPPRESSION (per source sequence number window)
+#define DLL_DEDUP
+
+// CSMA MEDIUM ACCESS FOR RS-485 MULTI-DROP BUSES (see mac.hpp)
+// #define DLL_CSMA
+
+// STATIC MEMORY (fixed blocks instead of the heap, see mem.cpp)
+// #define DLL_STATIC
+
 // PRINT ESC AND FLAGS
 #define PRINT_ESC_FLAG
 
@@ -17,6 +41,15 @@
 // #define DEBUG_MEM
 // #define DEBUG_MEM_ELABORATE
 
+// HOST TOOLS (gateway etc.) run real DLLs side by side, built with -DWINDOWS -DHOST_TOOL
+#ifdef HOST_TOOL
+    #undef DLL_TEST
+    #undef DEBUG_DLL_TEST
+    #undef DEBUG_DLL_STEPS
+    #undef DLL_CAPTURE // the ring buffer is shared by every DLL
+    #undef DLL_STATIC  // so are the memory blocks
+#endif
+
 #ifdef WINDOWS
     #include <stdio.h>
     #define put_ch(ch) putchar(ch)
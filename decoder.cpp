@@ -0,0 +1,517 @@
+// Host tool: decodes a raw serial capture of DLL traffic
+//
+// Usage: decoder [-j threads] [-o packets.txt] capture
+//
+// The capture is memory mapped and decoded a window at a time, so memory use
+// does not grow with the capture. Each window is split into one chunk per
+// thread. Each thread resynchronises on the first unescaped FLAG in its
+// chunk, then destuffs and CRC checks every frame that opens inside the
+// chunk (finishing the last one past the chunk end). A second pass, sharded
+// by source address, reassembles split packets in stream order across chunk
+// and window boundaries. Retransmissions of packets already decoded are
+// dropped with the receiver's duplicate window. Packets are written in stream order as
+// "<offset> <source> <destination> <hex bytes>" lines.
+#include "dll.hpp"
+#include "framer.hpp"
+#include "lzss.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Bytes of capture decoded at a time, memory use is a few times this
+#ifndef WINDOW_SIZE
+    #define WINDOW_SIZE (8UL << 20)
+#endif
+
+struct Decoded {
+    uint64_t offset; // of the opening FLAG
+    uint8_t status; // DROP_NONE, DROP_CRC or DROP_FORMAT
+    uint8_t control[2];
+    uint8_t addressing[2];
+    uint8_t sequence;
+    uint8_t length;
+    uint32_t data; // index into the chunk's packet bytes
+    uint32_t framing_errors; // since the frame before
+};
+
+struct Chunk {
+    uint64_t start;
+    uint64_t end;
+    bool synced; // start is known to be between frames
+    std::vector<Decoded> frames;
+    std::vector<uint8_t> bytes;
+    uint64_t stop; // first byte not scanned
+    uint64_t framing_errors; // after the last frame
+};
+
+struct Packet {
+    uint64_t offset; // of the first frame
+    uint8_t source;
+    uint8_t destination;
+    std::vector<uint8_t> data;
+};
+
+// Per source statistics
+struct Source {
+    uint64_t frames;
+    uint64_t link_frames;
+    uint64_t packets;
+    uint64_t packet_bytes;
+    uint64_t incomplete; // split packets with missing frames
+    uint64_t duplicates; // retransmissions of packets already decoded
+    uint64_t decompress_errors;
+};
+
+struct Reassembly {
+    bool active;
+    uint8_t next;
+    uint8_t last;
+    uint8_t destination;
+    uint64_t offset;
+    std::vector<uint8_t> data;
+};
+
+// Carried from window to window
+struct Shard {
+    std::vector<Packet> packets; // not written yet
+    Source sources[256];
+    Dedup windows[256]; // sequence numbers decoded, as a receiver keeps them
+    std::vector<Reassembly> reassemblies;
+
+    Shard() : reassemblies(256) {
+        memset(sources, 0, sizeof(sources));
+        memset(windows, 0, sizeof(windows));
+    }
+};
+
+// A FLAG preceded by an odd number of ESCs is data
+bool escaped(const uint8_t* capture, uint64_t index) {
+    uint64_t num_escapes = 0;
+    while (index > num_escapes and capture[index - num_escapes - 1] == ESC) {
+        num_escapes++;
+    }
+    return num_escapes % 2 == 1;
+}
+
+// Destuffs and checks frames, keeping the opening flag offset of each
+class Scanner {
+  public:
+    Scanner(const uint8_t* capture, uint64_t size) : capture(capture), size(size) {
+        decoded.net_packet = packet;
+    }
+
+    // Scans from index, a position between frames, until the first frame
+    // opening at or after end. Returns where it stopped.
+    uint64_t scan(uint64_t index, uint64_t end, Chunk& chunk) {
+        framer.reset();
+        bool between_frames = true;
+        for (; index < size; index++) {
+            if (index >= end and between_frames) {
+                break;
+            }
+            if (push(index, chunk)) {
+                between_frames = true;
+                continue;
+            }
+            if (framer.frame_length == 1) {
+                opening = index;
+            }
+            between_frames = framer.frame_length == 0;
+        }
+        chunk.framing_errors += framer.errors - errors;
+        return index;
+    }
+
+    // Scans from index until a frame is found that a later chunk also
+    // decoded, which puts both in step. Returns the index of that chunk, or
+    // the number of chunks after stopping at the first frame opening at or
+    // after end.
+    size_t resync(uint64_t index, uint64_t end, Chunk& chunk, std::vector<Chunk>& chunks, size_t next) {
+        framer.reset();
+        bool between_frames = true;
+        for (; index < size; index++) {
+            if (next == chunks.size() and index >= end and between_frames) {
+                break;
+            }
+            if (push(index, chunk)) {
+                between_frames = true;
+                Decoded& frame = chunk.frames.back();
+                while (next < chunks.size() and chunks[next].end <= frame.offset) {
+                    chunks[next].frames.clear();
+                    chunks[next].framing_errors = 0;
+                    next++;
+                }
+                if (next == chunks.size()) {
+                    continue;
+                }
+                std::vector<Decoded>& frames = chunks[next].frames;
+                std::vector<Decoded>::iterator match = frames.begin();
+                while (match != frames.end() and match->offset < frame.offset) {
+                    match++;
+                }
+                if (match != frames.end() and match->offset == frame.offset) {
+                    match->framing_errors = frame.framing_errors;
+                    chunk.frames.pop_back();
+                    frames.erase(frames.begin(), match);
+                    return next;
+                }
+                continue;
+            }
+            if (framer.frame_length == 1) {
+                opening = index;
+            }
+            between_frames = framer.frame_length == 0;
+        }
+        for (; next < chunks.size(); next++) {
+            chunks[next].frames.clear();
+            chunks[next].framing_errors = 0;
+        }
+        chunk.framing_errors += framer.errors - errors;
+        chunk.stop = index;
+        return next;
+    }
+
+  private:
+    const uint8_t* capture;
+    uint64_t size;
+    DLL dll;
+    Framer framer;
+    uint64_t opening;
+    uint32_t errors = 0; // framer errors before the current frame
+    uint8_t packet[255];
+    Frame decoded;
+
+    bool push(uint64_t index, Chunk& chunk) {
+        if (not framer.push(capture[index])) {
+            return false;
+        }
+        Decoded frame;
+        frame.offset = opening;
+        frame.framing_errors = framer.errors - errors;
+        errors = framer.errors;
+        frame.status = dll.decode(framer.frame, framer.frame_length, decoded);
+        frame.control[0] = decoded.control[0];
+        frame.control[1] = decoded.control[1];
+        frame.addressing[0] = decoded.addressing[0];
+        frame.addressing[1] = decoded.addressing[1];
+        frame.sequence = decoded.sequence;
+        frame.length = frame.status == DROP_FORMAT ? 0 : decoded.length;
+        frame.data = chunk.bytes.size();
+        chunk.bytes.insert(chunk.bytes.end(), packet, packet + frame.length);
+        chunk.frames.push_back(frame);
+        return true;
+    }
+};
+
+void decode_chunk(const uint8_t* capture, uint64_t size, Chunk& chunk) {
+    Scanner scanner(capture, size);
+    uint64_t index = chunk.start;
+    while (not chunk.synced and index < chunk.end and (capture[index] != FLAG or escaped(capture, index))) {
+        index++;
+    }
+    chunk.stop = scanner.scan(index, chunk.end, chunk);
+}
+
+void emit(Shard& shard, Source& source, uint64_t offset, uint8_t source_address, uint8_t destination_address,
+          const uint8_t* data, uint8_t length, bool compressed) {
+    Packet packet = {offset, source_address, destination_address, std::vector<uint8_t>()};
+    if (compressed) {
+        uint8_t decompressed[255];
+        uint8_t decompressed_length = decompress((uint8_t*) data, length, decompressed, sizeof(decompressed));
+        if (decompressed_length == 0) {
+            source.decompress_errors++;
+            return;
+        }
+        packet.data.assign(decompressed, decompressed + decompressed_length);
+    } else {
+        packet.data.assign(data, data + length);
+    }
+    source.packets++;
+    source.packet_bytes += packet.data.size();
+    shard.packets.push_back(std::move(packet));
+}
+
+// Reassembles the packets of every source address congruent to shard_num.
+// Split packets that opened before stale_before are given up on.
+void reassemble(std::vector<Chunk>& chunks, Shard& shard, unsigned shard_num, unsigned num_shards, uint64_t stale_before) {
+    std::vector<Reassembly>& reassemblies = shard.reassemblies;
+    for (unsigned address = shard_num; address < 256; address += num_shards) {
+        if (reassemblies[address].active and reassemblies[address].offset < stale_before) {
+            reassemblies[address].active = false;
+            shard.sources[address].incomplete++;
+        }
+    }
+    for (Chunk& chunk : chunks) {
+        for (Decoded& frame : chunk.frames) {
+            uint8_t source_address = frame.addressing[0];
+            if (frame.status != DROP_NONE or source_address % num_shards != shard_num) {
+                continue;
+            }
+            Source& source = shard.sources[source_address];
+            Dedup& window = shard.windows[source_address];
+            source.frames++;
+            if (frame.control[1] & CONTROL_LINK) {
+                source.link_frames++;
+                if (frame.control[0] == LINK_SEQUENCE_RESET) {
+                    window.delivered = 0;
+                }
+                continue;
+            }
+            if (dedup_seen(window, frame.sequence)) {
+                // Dropped frame by frame like the receiver does, counted once
+                if (frame.control[0] == (frame.control[1] & CONTROL_LAST_FRAME)) {
+                    source.duplicates++;
+                }
+                continue;
+            }
+            const uint8_t* data = &chunk.bytes[frame.data];
+            uint8_t last = frame.control[1] & CONTROL_LAST_FRAME;
+            bool compressed = frame.control[1] & CONTROL_COMPRESSED;
+            Reassembly& reassembly = reassemblies[source_address];
+            if (last == 0) {
+                dedup_mark(window, frame.sequence);
+                emit(shard, source, frame.offset, source_address, frame.addressing[1], data, frame.length, compressed);
+                continue;
+            }
+            if (frame.control[0] == 0) {
+                if (reassembly.active) {
+                    source.incomplete++;
+                }
+                reassembly.active = true;
+                reassembly.next = 0;
+                reassembly.last = last;
+                reassembly.destination = frame.addressing[1];
+                reassembly.offset = frame.offset;
+                reassembly.data.clear();
+            } else if (not reassembly.active or frame.control[0] != reassembly.next or last != reassembly.last) {
+                // Missing frame, drop the rest of this packet
+                if (reassembly.active) {
+                    source.incomplete++;
+                }
+                reassembly.active = false;
+                continue;
+            }
+            reassembly.data.insert(reassembly.data.end(), data, data + frame.length);
+            reassembly.next++;
+            if (frame.control[0] == last) {
+                reassembly.active = false;
+                if (reassembly.data.size() > 255) {
+                    source.incomplete++;
+                    continue;
+                }
+                dedup_mark(window, frame.sequence);
+                emit(shard, source, reassembly.offset, source_address, reassembly.destination,
+                     reassembly.data.data(), reassembly.data.size(), compressed);
+            }
+        }
+    }
+    // Split packets complete after later ones start, put back in stream order
+    std::stable_sort(shard.packets.begin(), shard.packets.end(),
+                     [](const Packet& a, const Packet& b) { return a.offset < b.offset; });
+}
+
+// Writes the packets of every shard that open before limit in stream order
+// (output may be NULL) and forgets them
+void write_packets(std::vector<Shard>& shards, FILE* output, uint64_t limit) {
+    typedef std::pair<uint64_t, std::pair<size_t, size_t>> Head; // offset, shard, packet
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+    std::vector<size_t> written(shards.size(), 0);
+    for (size_t i = 0; i < shards.size(); i++) {
+        if (not shards[i].packets.empty() and shards[i].packets[0].offset < limit) {
+            heads.push(Head(shards[i].packets[0].offset, std::make_pair(i, 0)));
+        }
+    }
+    while (not heads.empty()) {
+        Head head = heads.top();
+        heads.pop();
+        Shard& shard = shards[head.second.first];
+        Packet& packet = shard.packets[head.second.second];
+        if (output != NULL) {
+            fprintf(output, "%lu %02X %02X", packet.offset, packet.source, packet.destination);
+            for (uint8_t byte : packet.data) {
+                fprintf(output, " %02X", byte);
+            }
+            fputc('\n', output);
+        }
+        size_t next = head.second.second + 1;
+        written[head.second.first] = next;
+        if (next < shard.packets.size() and shard.packets[next].offset < limit) {
+            heads.push(Head(shard.packets[next].offset, std::make_pair(head.second.first, next)));
+        }
+    }
+    for (size_t i = 0; i < shards.size(); i++) {
+        shards[i].packets.erase(shards[i].packets.begin(), shards[i].packets.begin() + written[i]);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    unsigned num_threads = std::thread::hardware_concurrency();
+    const char* output_path = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "j:o:")) != -1) {
+        switch (option) {
+            case 'j': num_threads = atoi(optarg); break;
+            case 'o': output_path = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-j threads] [-o packets.txt] capture\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-j threads] [-o packets.txt] capture\n", argv[0]);
+        return 1;
+    }
+    if (num_threads == 0) {
+        num_threads = 1;
+    }
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat status;
+    if (fd < 0 or fstat(fd, &status) != 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    uint64_t size = status.st_size;
+    if (size == 0) {
+        fprintf(stderr, "%s is empty\n", argv[optind]);
+        return 1;
+    }
+    const uint8_t* capture = (const uint8_t*) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (capture == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    madvise((void*) capture, size, MADV_SEQUENTIAL);
+    FILE* output = NULL;
+    if (output_path != NULL) {
+        output = strcmp(output_path, "-") == 0 ? stdout : fopen(output_path, "w");
+        if (output == NULL) {
+            perror(output_path);
+            return 1;
+        }
+    }
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+    std::vector<Shard> shards(num_threads);
+    uint64_t frames = 0, framing_errors = 0, format_errors = 0, crc_errors = 0;
+    uint64_t window_start = 0;
+    uint64_t released = 0; // capture pages handed back to the kernel
+    while (window_start < size) {
+        uint64_t window_end = std::min(size, window_start + WINDOW_SIZE);
+        // Pass 1: frames, one chunk per thread. The first chunk carries on
+        // from where the last window stopped, between frames.
+        std::vector<Chunk> chunks(num_threads);
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < num_threads; i++) {
+            chunks[i].framing_errors = 0;
+            chunks[i].start = window_start + (window_end - window_start) * i / num_threads;
+            chunks[i].end = window_start + (window_end - window_start) * (i + 1) / num_threads;
+            chunks[i].synced = i == 0 and window_start > 0;
+            threads.push_back(std::thread(decode_chunk, capture, size, std::ref(chunks[i])));
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+        threads.clear();
+        // A chunk may have started on a closing flag. Carry on from where the
+        // chunk before it stopped until the two decode the same frame.
+        uint64_t window_stop = chunks.back().stop;
+        for (size_t i = 0; i + 1 < chunks.size();) {
+            Scanner scanner(capture, size);
+            size_t next = i + 1;
+            if (chunks[i].stop < size and (chunks[next].frames.empty() or chunks[next].frames[0].offset != chunks[i].stop)) {
+                next = scanner.resync(chunks[i].stop, window_end, chunks[i], chunks, next);
+                if (next == chunks.size()) {
+                    window_stop = chunks[i].stop;
+                }
+            }
+            i = next;
+        }
+
+        // Pass 2: packets, one shard of source addresses per thread
+        uint64_t stale_before = window_start > WINDOW_SIZE ? window_start - WINDOW_SIZE : 0;
+        for (unsigned i = 0; i < num_threads; i++) {
+            threads.push_back(std::thread(reassemble, std::ref(chunks), std::ref(shards[i]), i, num_threads, stale_before));
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+
+        for (Chunk& chunk : chunks) {
+            frames += chunk.frames.size();
+            framing_errors += chunk.framing_errors;
+            for (Decoded& frame : chunk.frames) {
+                framing_errors += frame.framing_errors;
+                format_errors += frame.status == DROP_FORMAT;
+                crc_errors += frame.status == DROP_CRC;
+            }
+        }
+        // Packets still to come open at or after the earliest split packet
+        // being reassembled, or in the next window
+        uint64_t written_before = window_stop;
+        for (Shard& shard : shards) {
+            for (Reassembly& reassembly : shard.reassemblies) {
+                if (reassembly.active) {
+                    written_before = std::min(written_before, reassembly.offset);
+                }
+            }
+        }
+        write_packets(shards, output, written_before);
+        uint64_t page_size = sysconf(_SC_PAGESIZE);
+        uint64_t release_end = window_stop / page_size * page_size;
+        if (release_end > released) {
+            madvise((void*) (capture + released), release_end - released, MADV_DONTNEED);
+            released = release_end;
+        }
+        window_start = window_stop;
+    }
+    for (Shard& shard : shards) {
+        for (Reassembly& reassembly : shard.reassemblies) {
+            if (reassembly.active) {
+                shard.sources[&reassembly - &shard.reassemblies[0]].incomplete++;
+            }
+        }
+    }
+    write_packets(shards, output, UINT64_MAX);
+    if (output != NULL and output != stdout) {
+        fclose(output);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+    Source total = {};
+    fprintf(stderr, "Source  Frames      Link        Packets     Bytes         Incomplete  Duplicates  Decompress\n");
+    for (unsigned address = 0; address < 256; address++) {
+        Source& source = shards[address % num_threads].sources[address];
+        if (source.frames == 0) {
+            continue;
+        }
+        fprintf(stderr, "0x%02X    %-11lu %-11lu %-11lu %-13lu %-11lu %-11lu %lu\n", address, source.frames,
+                source.link_frames, source.packets, source.packet_bytes, source.incomplete, source.duplicates,
+                source.decompress_errors);
+        total.packets += source.packets;
+        total.packet_bytes += source.packet_bytes;
+        total.incomplete += source.incomplete;
+        total.duplicates += source.duplicates;
+        total.decompress_errors += source.decompress_errors;
+    }
+    fprintf(stderr, "%lu bytes in %.2f s (%.1f MB/s) with %u threads\n", size, seconds, size / seconds / 1e6, num_threads);
+    fprintf(stderr, "Frames:             %lu\n", frames);
+    fprintf(stderr, "Framing errors:     %lu\n", framing_errors);
+    fprintf(stderr, "Format errors:      %lu\n", format_errors);
+    fprintf(stderr, "CRC errors:         %lu\n", crc_errors);
+    fprintf(stderr, "Packets:            %lu (%lu bytes)\n", total.packets, total.packet_bytes);
+    fprintf(stderr, "Incomplete packets: %lu\n", total.incomplete);
+    fprintf(stderr, "Duplicate packets:  %lu\n", total.duplicates);
+    fprintf(stderr, "Decompress errors:  %lu\n", total.decompress_errors);
+    munmap((void*) capture, size);
+    close(fd);
+    return 0;
+}
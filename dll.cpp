@@ -1,5 +1,9 @@
 #include "dll.hpp"
 #include "mem.hpp"
+#include "prof.hpp"
+#include "capture.hpp"
+#include "lzss.hpp"
+#include "mac.hpp"
 #include <string.h>
 
 #ifdef DEBUG_MEM_ELABORATE
@@ -8,21 +12,67 @@
     #define deallocate(x, ...) put_str(#x); put_str(": "); deallocate(x, ##__VA_ARGS__)
 #endif
 
-void DLL::send(uint8_t* packet, uint8_t packet_length, uint8_t destination_address) {
-    bool extra_frame = packet_length % MAX_PACKET_LENGTH;
-    uint8_t last_frame_num = packet_length/MAX_PACKET_LENGTH + extra_frame - 1;
+// Sends a new packet, returning its sequence number for any retransmission
+uint8_t DLL::send(uint8_t* packet, uint8_t packet_length, uint8_t destination_address) {
+    uint8_t sequence = next_sequence++;
+    resend(packet, packet_length, destination_address, sequence);
+    return sequence;
+}
+
+// Sends a packet again under the sequence number it was first sent with, so
+// a receiver that already has it drops the copy
+void DLL::resend(uint8_t* packet, uint8_t packet_length, uint8_t destination_address, uint8_t sequence) {
+    // Empty packets would underflow the compression limit and the frame count
+    if (packet_length == 0) {
+        return;
+    }
+    uint8_t compressed = 0;
+    #ifdef DLL_COMPRESSION
+        // Only send the compressed packet if it is smaller, otherwise send it raw
+        uint8_t* compressed_packet = NULL;
+        uint8_t compressed_packet_length;
+        allocate(compressed_packet, compressed_packet_length, packet_length);
+        uint8_t length = 0;
+        if (compressed_packet != NULL) {
+            length = compress(packet, packet_length, compressed_packet, packet_length - 1);
+        }
+        if (length > 0) {
+            #ifdef DEBUG_DLL_STEPS
+                put_str("Compressed packet from "); put_uint8(packet_length); put_str(" to "); put_uint8(length); put_str(" bytes\r\n");
+            #endif
+            packet = compressed_packet;
+            packet_length = length;
+            compressed = CONTROL_COMPRESSED;
+        }
+    #endif
+    // Frames to poor links carry less, see update_fragment_length(). A resend
+    // keeps the original split so the receiver can fill in missing frames.
+    uint8_t split_length;
+    if (sequence == last_sequence and destination_address == last_destination) {
+        split_length = last_fragment_length;
+    } else {
+        split_length = fragment_length(destination_address);
+        last_sequence = sequence;
+        last_destination = destination_address;
+        last_fragment_length = split_length;
+    }
+    #ifdef DEBUG_DLL_STEPS
+        put_str("Fragment length: "); put_uint8(split_length); put_str("\r\n");
+    #endif
+    bool extra_frame = packet_length % split_length;
+    uint8_t last_frame_num = packet_length/split_length + extra_frame - 1;
     for (uint8_t frame_num = 0; frame_num <= last_frame_num; frame_num++) {
         #ifdef DEBUG_DLL
             put_str("\r\nSENDING FRAME\r\n");
         #endif
         uint8_t frame_packet_length;
         if (frame_num == last_frame_num) {
-            frame_packet_length = packet_length - last_frame_num*MAX_PACKET_LENGTH;
+            frame_packet_length = packet_length - last_frame_num*split_length;
         } else {
-            frame_packet_length = MAX_PACKET_LENGTH;
+            frame_packet_length = split_length;
         }
         frame.control[0] = frame_num;
-        frame.control[1] = last_frame_num;
+        frame.control[1] = last_frame_num | compressed;
         #ifdef DEBUG_DLL_STEPS
             if (last_frame_num > 0) {
                 put_str("Frame sending as ");
@@ -31,10 +81,10 @@ void DLL::send(uint8_t* packet, uint8_t packet_length, uint8_t destination_addre
                 } else {
                     put_str("final");
                 }
-                put_str(" split packet "); put_uint8(frame.control[0]+1); put_ch('/'); put_uint8(frame.control[1]+1); put_str("\r\n"); 
+                put_str(" split packet "); put_uint8(frame.control[0]+1); put_ch('/'); put_uint8(last_frame_num+1); put_str("\r\n"); 
             }
         #endif
-        frame.addressing[0] = MAC_ADDRESS;
+        frame.addressing[0] = address;
         #ifdef DEBUG_DLL_STEPS
             put_str("Device address: "); put_hex(frame.addressing[0]); put_str("\r\n");
         #endif
@@ -42,55 +92,128 @@ void DLL::send(uint8_t* packet, uint8_t packet_length, uint8_t destination_addre
         #ifdef DEBUG_DLL_STEPS
             put_str("Destination address: "); put_hex(frame.addressing[1]); put_str("\r\n");
         #endif
+        frame.sequence = sequence;
         allocate(frame.net_packet, frame.length, frame_packet_length);
+        if (frame.net_packet == NULL) {
+            // Leaves a gap for a retransmission to fill
+            #ifdef DEBUG_DLL
+                put_str("Dropping frame: Out of memory\r\n");
+            #endif
+            drop_unsent(DROP_MEMORY);
+            continue;
+        }
         for (uint8_t i = 0; i < frame_packet_length; i++) {
-            frame.net_packet[i] = packet[frame_num*MAX_PACKET_LENGTH + i]; 
+            frame.net_packet[i] = packet[frame_num*split_length + i]; 
         }
         #ifdef DEBUG_DLL_STEPS
             put_str("NET packet length: "); put_uint8(frame.length); put_str("\r\n");
             put_str("NET packet: "); print(frame.net_packet, frame.length);
             put_str("Calculating CRC...\r\n");
         #endif
-        uint16_t crc = calculate_crc();
-        frame.checksum[0] = (crc & 0xFF00) >> 8;
-        frame.checksum[1] = (crc & 0x00FF);
-        #ifdef DEBUG_DLL_STEPS
-            put_str("CRC: "); put_hex(frame.checksum[0]); put_ch(' '); put_hex(frame.checksum[1]); put_str("\r\n");
-        #endif
-        #ifdef DEBUG_DLL_FRAMES
-            put_str("Constructed frame:\r\n");
-            print(frame);
-        #endif
-        #ifdef DEBUG_DLL_STEPS
-            put_str("Stuffing bytes...\r\n");
-        #endif
-        byte_stuff(); // allocates memory
-        #ifdef DEBUG_DLL_FRAMES
-            put_str("Stuffed frame:\r\n"); print(stuffed_frame, stuffed_frame_length);
+        transmit();
+    }
+    #ifdef DLL_COMPRESSION
+        deallocate(compressed_packet, compressed_packet_length);
+    #endif
+}
+
+// Checksums, stuffs and transmits the frame, then frees its NET packet
+void DLL::transmit() {
+    PROFILE_START(send_start);
+    uint16_t crc = calculate_crc();
+    frame.checksum[0] = (crc & 0xFF00) >> 8;
+    frame.checksum[1] = (crc & 0x00FF);
+    #ifdef DEBUG_DLL_STEPS
+        put_str("CRC: "); put_hex(frame.checksum[0]); put_ch(' '); put_hex(frame.checksum[1]); put_str("\r\n");
+    #endif
+    #ifdef DEBUG_DLL_FRAMES
+        put_str("Constructed frame:\r\n");
+        print(frame);
+    #endif
+    #ifdef DEBUG_DLL_STEPS
+        put_str("Stuffing bytes...\r\n");
+    #endif
+    if (byte_stuff() == false) { // allocates memory
+        #ifdef DEBUG_DLL
+            put_str("Dropping frame: Out of memory\r\n");
         #endif
+        drop_unsent(DROP_MEMORY);
         deallocate(frame.net_packet, frame.length);
-        #ifndef DLL_TEST
+        return;
+    }
+    #ifdef DEBUG_DLL_FRAMES
+        put_str("Stuffed frame:\r\n"); print(stuffed_frame, stuffed_frame_length);
+    #endif
+    deallocate(frame.net_packet, frame.length);
+    PROFILE_STOP(PROFILE_SEND, send_start);
+    #ifdef DLL_CAPTURE
+        capture_frame(CAPTURE_TX, stuffed_frame, stuffed_frame_length);
+    #endif
+    #ifndef DLL_TEST
+        #ifdef DLL_CSMA
+            #ifdef DEBUG_DLL
+                put_str("Passing frame to MAC\r\n");
+            #endif
+            if (mac_send(stuffed_frame, stuffed_frame_length) == false) {
+                #ifdef DEBUG_DLL
+                    put_str("Dropping frame: Too many collisions\r\n");
+                #endif
+            }
+        #else
             #ifdef DEBUG_DLL
                 put_str("Passing frame to PHY\r\n");
             #endif
             phy->send(stuffed_frame, stuffed_frame_length);
-        #else
+        #endif
+    #else
+        if (lose_frame != 0 and not (frame.control[1] & CONTROL_LINK) and frame.control[0] == lose_frame) {
+            #ifdef DEBUG_DLL
+                put_str("Losing frame in virtual DLL\r\n");
+            #endif
+            lose_frame = 0;
+        } else {
             #ifdef DEBUG_DLL
                 put_str("Passing frame to virtual DLL\r\n");
             #endif
             receive(stuffed_frame, stuffed_frame_length);
-        #endif
-        // Deallocate the stuffed frame
-        deallocate(stuffed_frame, stuffed_frame_length);
-    }
+        }
+    #endif
+    // Deallocate the stuffed frame
+    deallocate(stuffed_frame, stuffed_frame_length);
 }
 
 void DLL::receive(uint8_t* received_frame, uint8_t received_frame_length) {
+    PROFILE_START(receive_start);
+    #ifdef DLL_CAPTURE
+        capture_frame(0, received_frame, received_frame_length);
+    #endif
+    process(received_frame, received_frame_length);
+    PROFILE_STOP(PROFILE_RECEIVE, receive_start);
+}
+
+void DLL::process(uint8_t* received_frame, uint8_t received_frame_length) {
     #ifdef DEBUG_DLL
         put_str("\r\nRECEIVING FRAME\r\n");
     #endif
     #ifndef DLL_TEST
+        #ifdef DLL_STATIC
+            // A frame longer than ours would not fit in a memory block
+            if (received_frame_length > MAX_STUFFED_FRAME_LENGTH) {
+                #ifdef DEBUG_DLL
+                    put_str("Dropping frame: Frame too long\r\n");
+                #endif
+                drop(DROP_FORMAT);
+                return;
+            }
+        #endif
         allocate(stuffed_frame, stuffed_frame_length, received_frame_length);
+        if (stuffed_frame == NULL) {
+            #ifdef DEBUG_DLL
+                put_str("Dropping frame: Out of memory\r\n");
+            #endif
+            drop(DROP_MEMORY);
+            return;
+        }
     #endif
     memcpy(stuffed_frame, received_frame, stuffed_frame_length);
 
@@ -101,160 +224,419 @@ void DLL::receive(uint8_t* received_frame, uint8_t received_frame_length) {
     #ifdef DEBUG_DLL_STEPS
         put_str("Destuffing bytes...\r\n");
     #endif
-    de_byte_stuff(); // allocates memory
+    uint8_t destuff_error = de_byte_stuff(); // allocates memory
+    deallocate(stuffed_frame, stuffed_frame_length);
+    if (destuff_error != DROP_NONE) {
+        #ifdef DEBUG_DLL
+            if (destuff_error == DROP_MEMORY) {
+                put_str("Dropping frame: Out of memory\r\n");
+            } else {
+                put_str("Dropping frame: Frame length does not match header\r\n");
+            }
+        #endif
+        drop(destuff_error);
+        return;
+    }
     #ifdef DEBUG_DLL_FRAMES
         put_str("Received frame:\r\n");
         print(frame);
     #endif
-    deallocate(stuffed_frame, stuffed_frame_length);
 
     #ifdef DEBUG_DLL_STEPS
         put_str("Checking destination address...\r\n");
         put_str("Destination address: "); put_hex(frame.addressing[1]); put_str(", ");
-        put_str("Device address: "); put_hex(MAC_ADDRESS); put_str("\r\n");
+        put_str("Device address: "); put_hex(address); put_str("\r\n");
     #endif
     // Check that destination MAC address in frame matches local MAC address or is in broadcast mode
-    if (frame.addressing[1] != MAC_ADDRESS and frame.addressing[1] != 0xFF) {
+    if (frame.addressing[1] != address and frame.addressing[1] != 0xFF) {
         #ifdef DEBUG_DLL_STEPS
             put_str("Destination address check failed\r\n"); 
         #endif
         #ifdef DEBUG_DLL
             put_str("Dropping frame: Destination address does not match devices\r\n");
         #endif
+        drop(DROP_ADDRESS);
         return;
     }
     #ifdef DEBUG_DLL_STEPS
         put_str("Destination address check passed\r\n"); 
     #endif
-    // Error in split packet handling
-    if (split_packet_error == true) {
-        // Reset error flag to 0 on last split packet
-        if (frame.control[0] == frame.control[1]) {
-            split_packet_error = false;
+    // Link control frames are consumed by the DLL and never reach NET
+    if (frame.control[1] & CONTROL_LINK) {
+        bool link_error = check_crc();
+        #ifdef DLL_LINK_QUALITY
+            count_quality(link_error, received_frame_length);
+        #endif
+        if (link_error == true) {
+            #ifdef DEBUG_DLL
+                put_str("Dropping frame: Error detected in link control frame\r\n");
+            #endif
+            drop(DROP_CRC);
+            #ifdef DLL_RATE_NEGOTIATION
+                count_frame(true);
+            #endif
+            return;
         }
-        #ifdef DEBUG_DLL
-            put_str("Dropping frame: Error detected in previous split packet frame\r\n");
+        #ifdef DLL_RATE_NEGOTIATION
+            count_frame(false);
         #endif
-        // Drop all split packet frames
+        receive_link();
         return;
     }
+    uint8_t last_frame_num = frame.control[1] & CONTROL_LAST_FRAME;
+    bool compressed = frame.control[1] & CONTROL_COMPRESSED;
     
     #ifdef DEBUG_DLL_STEPS
         put_str("Checking CRC...\r\n"); 
     #endif
     // Error in current frame handling
     bool frame_error = check_crc();
+    #ifdef DLL_LINK_QUALITY
+        count_quality(frame_error, received_frame_length);
+    #endif
     if (frame_error == true) {
         #ifdef DEBUG_DLL_STEPS
             put_str("CRC check failed\r\n"); 
         #endif
-        if (frame.control[1] != 0) {
+        if (last_frame_num != 0) {
+            // Leaves a gap in the split packet for a retransmission to fill
             #ifdef DEBUG_DLL
                 put_str("Dropping frame: Error detected in split packet frame\r\n");
             #endif
-            split_packet_error = true;
         } else {
             #ifdef DEBUG_DLL
                 put_str("Dropping frame: Error detected in frame\r\n");
             #endif
         }
+        drop(DROP_CRC);
+        #ifdef DLL_RATE_NEGOTIATION
+            count_frame(true);
+        #endif
         return;
     }
     #ifdef DEBUG_DLL_STEPS
         put_str("CRC check passed\r\n"); 
     #endif
+    #ifdef DLL_RATE_NEGOTIATION
+        count_frame(false);
+    #endif
+    #ifdef DLL_DEDUP
+        // Every frame of a delivered packet carries its sequence number, so
+        // a retransmission is dropped frame by frame without reassembly
+        if (duplicate() == true) {
+            #ifdef DEBUG_DLL
+                put_str("Dropping frame: Packet already delivered\r\n");
+            #endif
+            drop(DROP_DUPLICATE);
+            return;
+        }
+    #endif
 
 
     // Single packet (no split packets)
-    if (frame.control[1] == 0) {
+    if (last_frame_num == 0) {
         #ifdef DEBUG_DLL
             put_str("Received packet: "); print(frame.net_packet, frame.length);
         #endif
-        #ifndef DLL_TEST
-            #ifdef DEBUG_DLL
-                put_str("Passing packet to NET\r\n");
-            #endif
-            net->receive(frame.net_packet, frame.length, frame.addressing[0]);
-        #else
-            allocate(received_packet, received_packet_length, frame.length);
-            memcpy(received_packet, frame.net_packet, received_packet_length);
+        #ifdef DLL_DEDUP
+            mark_delivered();
         #endif
+        // NET may send from receive, which reuses the frame, so take the packet out of it
+        uint8_t* packet = frame.net_packet;
+        uint8_t packet_length = frame.length;
+        frame.net_packet = NULL;
+        frame.length = 0;
+        deliver(packet, packet_length, compressed);
         #ifdef DEBUG_DLL
             put_str("\r\n");
         #endif
+        deallocate(packet, packet_length);
+        return;
     // Split packet
     } else {
         #ifdef DEBUG_DLL_STEPS
             put_str("Frame detected as ");
-            if (frame.control[0] < frame.control[1]) {
+            if (frame.control[0] < last_frame_num) {
                 put_str("part of");
             } else {
                 put_str("final");
             }
-            put_str(" split packet "); put_uint8(frame.control[0]+1); put_ch('/'); put_uint8(frame.control[1]+1); put_str("\r\n"); 
+            put_str(" split packet "); put_uint8(frame.control[0]+1); put_ch('/'); put_uint8(last_frame_num+1); put_str("\r\n"); 
         #endif
-        // First split packet
-        if (frame.control[0] == 0) {
-            allocate(reconstructed_packet, reconstructed_packet_length, frame.length);
-            memcpy(reconstructed_packet, frame.net_packet, reconstructed_packet_length);
-            #ifdef DEBUG_DLL_STEPS
-                put_str("Split packet: "); print(frame.net_packet, frame.length);
-                put_str("Storing split packet...\r\n"); 
+        if (frame.control[0] > last_frame_num) {
+            #ifdef DEBUG_DLL
+                put_str("Dropping frame: Frame number past the final frame\r\n");
+            #endif
+            drop(DROP_FORMAT);
+            return;
+        }
+        // Give up on a split packet whose next frame is overdue
+        poll();
+        PROFILE_START(reassembly_start);
+        // Only one split packet is reassembled at a time
+        if (reconstructed_packet != NULL and (frame.addressing[0] != reconstructed_source
+                                              or frame.sequence != reconstructed_sequence)) {
+            if (frame.addressing[0] != reconstructed_source) {
+                #ifdef DEBUG_DLL
+                    put_str("Dropping frame: Split packet from another source in progress\r\n");
+                #endif
+                drop(DROP_SPLIT);
+                return;
+            }
+            // Source has moved on to its next packet
+            abandon_reassembly();
+        }
+        // Resent with a different fragment length, start again
+        if (reconstructed_packet != NULL and (last_frame_num != reconstructed_last_frame
+            or (frame.control[0] < last_frame_num and frame.length != reconstructed_fragment_length))) {
+            abandon_reassembly();
+        }
+        if (reconstructed_packet == NULL) {
+            if (frame.control[0] != 0) {
+                #ifdef DEBUG_DLL
+                    put_str("Dropping frame: Start of split packet missing\r\n");
+                #endif
+                drop(DROP_SPLIT);
+                return;
+            }
+            uint16_t packet_length = (uint16_t) (last_frame_num + 1) * frame.length;
+            allocate(reconstructed_packet, reconstructed_packet_length, packet_length < 255 ? packet_length : 255);
+            if (reconstructed_packet == NULL) {
+                #ifdef DEBUG_DLL
+                    put_str("Dropping frame: Out of memory\r\n");
+                #endif
+                drop(DROP_MEMORY);
+                return;
+            }
+            reconstructed_source = frame.addressing[0];
+            reconstructed_sequence = frame.sequence;
+            reconstructed_last_frame = last_frame_num;
+            reconstructed_fragment_length = frame.length;
+            reconstructed_missing = ((uint64_t) 2 << last_frame_num) - 1;
+        }
+        uint16_t offset = (uint16_t) frame.control[0] * reconstructed_fragment_length;
+        if (offset + frame.length > reconstructed_packet_length) {
+            #ifdef DEBUG_DLL
+                put_str("Dropping frame: Frame does not fit the split packet\r\n");
             #endif
+            drop(DROP_SPLIT);
+            return;
+        }
+        if (not (reconstructed_missing & ((uint64_t) 1 << frame.control[0]))) {
             #ifdef DEBUG_DLL
-                put_str("Partially reconstructed packet: "); print(reconstructed_packet, reconstructed_packet_length);
+                put_str("Dropping frame: Already have this frame of the split packet\r\n");
             #endif
-        // Nth split packet
-        } else {
-            // Increment reconstructed packet length
-            reallocate(reconstructed_packet, reconstructed_packet_length, reconstructed_packet_length + frame.length);
-            // Append new split packet onto reconstructed packet
-            memcpy(&reconstructed_packet[reconstructed_packet_length - frame.length], frame.net_packet, frame.length);
-            // Last split packet
-            #ifdef DEBUG_DLL_STEPS
-                put_str("Split packet: "); print(frame.net_packet, frame.length);
-                put_str("Storing split packet...\r\n");
+            drop(DROP_DUPLICATE);
+            return;
+        }
+        memcpy(&reconstructed_packet[offset], frame.net_packet, frame.length);
+        reconstructed_missing &= ~((uint64_t) 1 << frame.control[0]);
+        if (frame.control[0] == last_frame_num) {
+            reconstructed_end = offset + frame.length;
+        }
+        reconstructed_time = get_cycles();
+        #ifdef DEBUG_DLL_STEPS
+            put_str("Split packet: "); print(frame.net_packet, frame.length);
+            put_str("Storing split packet...\r\n");
+        #endif
+        #ifdef DEBUG_DLL
+            if (reconstructed_missing != 0) {
+                put_str("Partially");
+            } else {
+                put_str("Fully");
+            }
+            put_str(" reconstructed packet: "); print(reconstructed_packet, reconstructed_packet_length);
+        #endif
+        PROFILE_STOP(PROFILE_REASSEMBLY, reassembly_start);
+        deallocate(frame.net_packet, frame.length);
+        if (reconstructed_missing == 0) {
+            #ifdef DLL_DEDUP
+                mark_delivered();
             #endif
+            // Reassembly is finished before NET sees the packet, so a reply may start another
+            uint8_t* packet = reconstructed_packet;
+            uint8_t packet_length = reconstructed_packet_length;
+            reconstructed_packet = NULL;
+            reconstructed_packet_length = 0;
+            deliver(packet, reconstructed_end, compressed);
             #ifdef DEBUG_DLL
-                if (frame.control[0] < frame.control[1]) {
-                    put_str("Partially");
-                } else {
-                    put_str("Fully");
-                }
-                put_str(" reconstructed packet: "); print(reconstructed_packet, reconstructed_packet_length);
+                put_str("\r\n");
             #endif
-            if (frame.control[0] == frame.control[1]) {
-                #ifndef DLL_TEST
-                    #ifdef DEBUG_DLL
-                        put_str("Passing packet to NET...\r\n");
-                    #endif
-                    net->receive(reconstructed_packet, reconstructed_packet_length, frame.addressing[0]);
-                #else
-                    allocate(received_packet, received_packet_length, reconstructed_packet_length);
-                    memcpy(received_packet, reconstructed_packet, reconstructed_packet_length);
+            // Free memory
+            deallocate(packet, packet_length);
+        }
+    }
+}
+
+// Frees a split packet that can no longer be completed
+void DLL::abandon_reassembly() {
+    #ifdef DEBUG_DLL
+        put_str("Dropping split packet: Frames missing\r\n");
+    #endif
+    drops[DROP_TIMEOUT]++;
+    deallocate(reconstructed_packet, reconstructed_packet_length);
+}
+
+// Runs the DLL's timers, call periodically while the link is idle
+void DLL::poll() {
+    // Expires a stalled split packet, which would otherwise block every other source's
+    if (reconstructed_packet != NULL and get_cycles() - reconstructed_time > reassembly_timeout()) {
+        abandon_reassembly();
+    }
+    #ifdef DLL_RATE_NEGOTIATION
+        // A lost switch, probe or result leaves the ends at different rates,
+        // where neither hears the other. Both then time out to the base rate.
+        uint32_t now = get_cycles();
+        if (rate_result_pending == true and now - rate_probe_time > RATE_RESULT_TIMEOUT) {
+            #ifdef DEBUG_DLL
+                put_str("Probe result overdue\r\n");
+            #endif
+            fallback_rate();
+        } else if (rate > BASE_RATE and now - rate_valid_time > RATE_FALLBACK_TIMEOUT) {
+            #ifdef DEBUG_DLL
+                put_str("No valid frames at link rate\r\n");
+            #endif
+            fallback_rate();
+        } else if (rate > BASE_RATE and now - rate_valid_time > RATE_KEEPALIVE_TIME
+                   and now - rate_keepalive_time > RATE_KEEPALIVE_TIME) {
+            // An idle link is not a failed one, the answer keeps both ends at the rate
+            uint8_t answer = 1;
+            rate_keepalive_time = now;
+            send_link(LINK_RATE_KEEPALIVE, &answer, 1, rate_peer);
+        }
+    #endif
+}
+
+// Counts and records a dropped frame and frees its NET packet
+void DLL::drop(uint8_t reason) {
+    count_drop(reason);
+    if (frame.net_packet != NULL) {
+        deallocate(frame.net_packet, frame.length);
+    }
+}
+
+// Counts a dropped frame and records the reason against the captured frame
+void DLL::count_drop(uint8_t reason) {
+    drops[reason]++;
+    #ifdef DLL_CAPTURE
+        capture_drop(reason);
+    #endif
+}
+
+// Counts a frame that could not be sent, captured as an empty sent frame
+void DLL::drop_unsent(uint8_t reason) {
+    #ifdef DLL_CAPTURE
+        capture_frame(CAPTURE_TX, NULL, 0);
+    #endif
+    count_drop(reason);
+}
+
+// Destuffs and checks a frame without passing it on, for offline decoding.
+// decoded.net_packet must have room for 255 bytes.
+uint8_t DLL::decode(uint8_t* received_frame, uint8_t received_frame_length, Frame& decoded) {
+    allocate(stuffed_frame, stuffed_frame_length, received_frame_length);
+    if (stuffed_frame == NULL) {
+        return DROP_MEMORY;
+    }
+    memcpy(stuffed_frame, received_frame, stuffed_frame_length);
+    uint8_t destuff_error = de_byte_stuff();
+    deallocate(stuffed_frame, stuffed_frame_length);
+    if (destuff_error != DROP_NONE) {
+        return destuff_error;
+    }
+    uint8_t reason = check_crc() ? DROP_CRC : DROP_NONE;
+    decoded.control[0] = frame.control[0];
+    decoded.control[1] = frame.control[1];
+    decoded.addressing[0] = frame.addressing[0];
+    decoded.addressing[1] = frame.addressing[1];
+    decoded.sequence = frame.sequence;
+    decoded.length = frame.length;
+    memcpy(decoded.net_packet, frame.net_packet, frame.length);
+    decoded.checksum[0] = frame.checksum[0];
+    decoded.checksum[1] = frame.checksum[1];
+    deallocate(frame.net_packet, frame.length);
+    return reason;
+}
+
+uint16_t DLL::drop_count(uint8_t reason) {
+    return drops[reason];
+}
+
+// Decompresses the packet if needed and passes it up to NET
+void DLL::deliver(uint8_t* packet, uint8_t packet_length, bool compressed) {
+    #ifdef DLL_COMPRESSION
+        uint8_t* decompressed_packet = NULL;
+        uint8_t decompressed_packet_length;
+        if (compressed == true) {
+            // Original length is the first byte of the compressed packet
+            allocate(decompressed_packet, decompressed_packet_length, packet[0]);
+            if (decompressed_packet == NULL) {
+                #ifdef DEBUG_DLL
+                    put_str("Dropping packet: Out of memory\r\n");
                 #endif
+                count_drop(DROP_MEMORY);
+                return;
+            }
+            if (decompress(packet, packet_length, decompressed_packet, decompressed_packet_length) == 0) {
                 #ifdef DEBUG_DLL
-                    put_str("\r\n");
+                    put_str("Dropping packet: Decompression failed\r\n");
                 #endif
-                // Free memory
-                deallocate(reconstructed_packet, reconstructed_packet_length);
+                count_drop(DROP_DECOMPRESS);
+                deallocate(decompressed_packet, decompressed_packet_length);
+                return;
             }
+            #ifdef DEBUG_DLL_STEPS
+                put_str("Decompressed packet: "); print(decompressed_packet, decompressed_packet_length);
+            #endif
+            packet = decompressed_packet;
+            packet_length = decompressed_packet_length;
         }
-    }
-    deallocate(frame.net_packet, frame.length);
+    #else
+        if (compressed == true) {
+            #ifdef DEBUG_DLL
+                put_str("Dropping packet: Compression not supported\r\n");
+            #endif
+            count_drop(DROP_DECOMPRESS);
+            return;
+        }
+    #endif
+    #ifndef DLL_TEST
+        #ifdef DEBUG_DLL
+            put_str("Passing packet to NET\r\n");
+        #endif
+        net->receive(packet, packet_length, frame.addressing[0]);
+    #else
+        allocate(received_packet, received_packet_length, packet_length);
+        if (received_packet == NULL) {
+            count_drop(DROP_MEMORY);
+        } else {
+            memcpy(received_packet, packet, received_packet_length);
+        }
+    #endif
+    #ifdef DLL_COMPRESSION
+        if (compressed == true) {
+            deallocate(decompressed_packet, decompressed_packet_length);
+        }
+    #endif
 }
 
-void DLL::byte_stuff() {
+// Returns false if there is no memory for the stuffed frame
+bool DLL::byte_stuff() {
+    PROFILE_START(stuff_start);
     uint8_t message_length;
     uint8_t* message = NULL;
-    allocate(message, message_length, 2 + 2 + 1 + frame.length + 2);
+    allocate(message, message_length, 2 + 2 + 1 + 1 + frame.length + 2);
+    if (message == NULL) {
+        return false;
+    }
     message[0] = frame.control[0];
     message[1] = frame.control[1];
     message[2] = frame.addressing[0];
     message[3] = frame.addressing[1];
-    message[4] = frame.length;
+    message[4] = frame.sequence;
+    message[5] = frame.length;
     for (uint8_t i = 0; i < frame.length; i++) {
-        message[5 + i] = frame.net_packet[i];
+        message[6 + i] = frame.net_packet[i];
     }
     message[message_length - 2] = frame.checksum[0];
     message[message_length - 1] = frame.checksum[1];
@@ -275,11 +657,12 @@ void DLL::byte_stuff() {
             #endif
             // Increment length of message
             reallocate(message, message_length, message_length + 1);
+            if (message == NULL) {
+                return false;
+            }
             // print(message, message_length);
             // Shift bytes after i right
-            uint8_t temp[message_length - i];
-            memcpy(temp, &message[i], message_length - i);
-            memcpy(&message[i + 1], temp, message_length - i);
+            memmove(&message[i + 1], &message[i], message_length - i - 1);
             // Insert ESC at i
             message[i] = ESC;
             // XOR escaped byte
@@ -294,17 +677,32 @@ void DLL::byte_stuff() {
     }
 
     allocate(stuffed_frame, stuffed_frame_length, 1 + message_length + 1);
+    if (stuffed_frame == NULL) {
+        deallocate(message, message_length);
+        return false;
+    }
     stuffed_frame[0] = FLAG;
     memcpy(&stuffed_frame[1], message, message_length);
     stuffed_frame[stuffed_frame_length - 1] = FLAG;
 
     deallocate(message, message_length);
+    PROFILE_STOP(PROFILE_STUFF, stuff_start);
+    return true;
 }
 
-void DLL::de_byte_stuff() {
+// Returns DROP_FORMAT if the frame is too short or its length byte does not
+// match, DROP_MEMORY if there is no memory for it, otherwise DROP_NONE
+uint8_t DLL::de_byte_stuff() {
+    PROFILE_START(destuff_start);
+    if (stuffed_frame_length < 2 + 2 + 2 + 1 + 1 + 2) {
+        return DROP_FORMAT;
+    }
     uint8_t message_length;
     uint8_t* message = NULL;
     allocate(message, message_length, stuffed_frame_length - 2);
+    if (message == NULL) {
+        return DROP_MEMORY;
+    }
     memcpy(message, &stuffed_frame[1], message_length);
     
     for (uint8_t i = 0; i < message_length; i++) {
@@ -314,51 +712,67 @@ void DLL::de_byte_stuff() {
                 put_str("Removing escape byte detected at byte "); put_uint8(i+1); put_str("...\r\n"); 
             #endif
             // Shift bytes after i left
-            memcpy(&message[i], &message[i + 1], message_length - i);
+            memmove(&message[i], &message[i + 1], message_length - i - 1);
             // XOR de-escaped byte
             // message[i] ^= 0x20;
             // Decrement message length
             reallocate(message, message_length, message_length - 1);
+            if (message == NULL) {
+                return DROP_MEMORY;
+            }
             #ifdef DEBUG_DLL_STEPS
                 print(message, message_length);
             #endif
         }
     }
 
+    if (message_length < 2 + 2 + 1 + 1 + 2 or message[5] != message_length - (2 + 2 + 1 + 1 + 2)) {
+        deallocate(message, message_length);
+        return DROP_FORMAT;
+    }
     frame.control[0] = message[0];
     frame.control[1] = message[1];
     frame.addressing[0] = message[2];
     frame.addressing[1] = message[3];
-    allocate(frame.net_packet, frame.length, message[4]);
-    memcpy(frame.net_packet, &message[5], frame.length);
+    frame.sequence = message[4];
+    allocate(frame.net_packet, frame.length, message[5]);
+    if (frame.net_packet == NULL and message[5] != 0) {
+        deallocate(message, message_length);
+        return DROP_MEMORY;
+    }
+    memcpy(frame.net_packet, &message[6], frame.length);
     frame.checksum[0] = message[message_length - 2];
     frame.checksum[1] = message[message_length - 1];
 
     deallocate(message, message_length);
+    PROFILE_STOP(PROFILE_DESTUFF, destuff_start);
+    return DROP_NONE;
 }
 
 uint16_t DLL::calculate_crc() {
-    // Copy frame contents into a byte array
-    uint8_t message_length = 2 + 2 + 1 + frame.length;
-    uint8_t message[message_length];
-    message[0] = frame.control[0];
-    message[1] = frame.control[1];
-    message[2] = frame.addressing[0];
-    message[3] = frame.addressing[1];
-    message[4] = frame.length;
-    for (uint8_t i = 0; i < frame.length; i++) {
-        message[5 + i] = frame.net_packet[i];
-    }
+    PROFILE_START(crc_start);
+    // Header bytes, followed by the NET packet
+    uint8_t header[6];
+    header[0] = frame.control[0];
+    header[1] = frame.control[1];
+    header[2] = frame.addressing[0];
+    header[3] = frame.addressing[1];
+    header[4] = frame.sequence;
+    header[5] = frame.length;
     #ifdef DEBUG_DLL_STEPS
-        put_str("Message: "); print(message, message_length);
+        put_str("Header: "); print(header, sizeof(header));
         put_str("Polynomial: "); put_hex(POLYNOMIAL); put_str("\r\n");
     #endif
     // Initialize the value of the CRC to 0
     uint16_t crc = 0;
     // Perform modulo-2 division, a byte at a time.
-    for (int byte = 0; byte < message_length; byte++) {
+    for (uint16_t byte = 0; byte < sizeof(header) + frame.length; byte++) {
         // Bring the next byte into the crc.
-        crc ^= message[byte] << 8;
+        if (byte < sizeof(header)) {
+            crc ^= header[byte] << 8;
+        } else {
+            crc ^= frame.net_packet[byte - sizeof(header)] << 8;
+        }
         // Perform modulo-2 division, a bit at a time.
         for (uint8_t bit = 8; bit > 0; bit--) {
             // Try to divide the current data bit.
@@ -369,6 +783,7 @@ uint16_t DLL::calculate_crc() {
             }
         }
     }
+    PROFILE_STOP(PROFILE_CRC, crc_start);
     return crc;
 }
 
@@ -388,6 +803,439 @@ bool DLL::check_crc() {
     }
 }
 
+#ifdef DLL_DEDUP
+Dedup* DLL::find_dedup(uint8_t source_address) {
+    for (uint8_t i = 0; i < DEDUP_SOURCES; i++) {
+        if (dedup[i].used and dedup[i].source == source_address) {
+            return &dedup[i];
+        }
+    }
+    return NULL;
+}
+
+// Returns true if the received frame belongs to a packet already delivered
+bool DLL::duplicate() {
+    Dedup* window = find_dedup(frame.addressing[0]);
+    return window != NULL and dedup_seen(*window, frame.sequence);
+}
+
+// Records the sequence number of the packet being delivered
+void DLL::mark_delivered() {
+    Dedup* window = find_dedup(frame.addressing[0]);
+    if (window == NULL) {
+        // Forget the source that was added longest ago
+        window = &dedup[dedup_next];
+        dedup_next = (dedup_next + 1) % DEDUP_SOURCES;
+        window->used = true;
+        window->source = frame.addressing[0];
+        window->delivered = 0;
+    }
+    dedup_mark(*window, frame.sequence);
+}
+
+// Tells every node that this one's sequence numbers start again, call once
+// at startup so receivers that remember it do not drop its new packets
+void DLL::announce_restart() {
+    send_link(LINK_SEQUENCE_RESET, &next_sequence, 1, 0xFF);
+}
+#endif
+
+#if defined(DLL_DEDUP) || defined(HOST_TOOL)
+bool dedup_seen(const Dedup& window, uint8_t sequence) {
+    uint8_t age = window.latest - sequence;
+    return age < DEDUP_WINDOW and (window.delivered & (1 << age));
+}
+
+void dedup_mark(Dedup& window, uint8_t sequence) {
+    uint8_t age = window.latest - sequence;
+    uint8_t ahead = sequence - window.latest;
+    if (window.delivered == 0) {
+        window.delivered = 1;
+        window.latest = sequence;
+    } else if (age < DEDUP_WINDOW) {
+        window.delivered |= 1 << age;
+    } else if (ahead < 128) {
+        // Slide the window forward
+        window.delivered = ahead < DEDUP_WINDOW ? window.delivered << ahead : 0;
+        window.delivered |= 1;
+        window.latest = sequence;
+    } else {
+        // Far behind the window, most likely the source restarted
+        window.delivered = 1;
+        window.latest = sequence;
+    }
+}
+#endif
+
+void DLL::send_link(uint8_t opcode, uint8_t* payload, uint8_t payload_length, uint8_t destination_address) {
+    #ifdef DEBUG_DLL
+        put_str("\r\nSENDING LINK FRAME\r\n");
+    #endif
+    frame.control[0] = opcode;
+    frame.control[1] = CONTROL_LINK;
+    frame.addressing[0] = address;
+    frame.addressing[1] = destination_address;
+    frame.sequence = 0;
+    allocate(frame.net_packet, frame.length, payload_length);
+    if (frame.net_packet == NULL and payload_length != 0) {
+        drop_unsent(DROP_MEMORY);
+        return;
+    }
+    memcpy(frame.net_packet, payload, frame.length);
+    transmit();
+}
+
+void DLL::receive_link() {
+    uint8_t opcode = frame.control[0];
+    uint8_t source_address = frame.addressing[0];
+    // Room for the longest link payload, the 4 byte echo timestamp
+    uint8_t payload[MAX_PACKET_LENGTH < 4 ? 4 : MAX_PACKET_LENGTH] = {0};
+    memcpy(payload, frame.net_packet, frame.length < MAX_PACKET_LENGTH ? frame.length : MAX_PACKET_LENGTH);
+    // Free the frame before replying, replies reuse it
+    deallocate(frame.net_packet, frame.length);
+    (void) source_address; // unused if no link features are enabled
+    switch (opcode) {
+        #ifdef DLL_RATE_NEGOTIATION
+        case LINK_RATE_OFFER: {
+            #ifdef DEBUG_DLL_STEPS
+                put_str("Rate offer received: "); put_hex(payload[0]); put_str("\r\n");
+            #endif
+            // Rate changes from here on go to the peer, not to broadcast
+            rate_peer = source_address;
+            uint8_t common_rates = payload[0] & SUPPORTED_RATES;
+            // Both ends step down a failed probe through the same rates
+            rate_mask = common_rates | (1 << BASE_RATE);
+            send_link(LINK_RATE_ACCEPT, &common_rates, 1, source_address);
+            break;
+        }
+        case LINK_RATE_ACCEPT: {
+            #ifdef DEBUG_DLL_STEPS
+                put_str("Rate accept received: "); put_hex(payload[0]); put_str("\r\n");
+            #endif
+            rate_peer = source_address;
+            rate_mask = payload[0] | (1 << BASE_RATE);
+            // Start probing from the highest common rate
+            for (uint8_t r = NUM_RATES - 1; r > BASE_RATE; r--) {
+                if (rate_mask & (1 << r)) {
+                    probe_rate(r);
+                    return;
+                }
+            }
+            rate_negotiated = true;
+            break;
+        }
+        case LINK_RATE_SWITCH:
+            rate_peer = source_address;
+            // Repeated switches and ones that start probes at the rate already set
+            if (payload[0] < NUM_RATES and payload[0] != rate) {
+                set_rate(payload[0]);
+            }
+            probe_good = 0;
+            break;
+        case LINK_RATE_PROBE:
+            probe_good++;
+            if (payload[0] == payload[1] - 1) {
+                send_link(LINK_RATE_RESULT, &probe_good, 1, source_address);
+                if (probe_good < RATE_PROBE_THRESHOLD) {
+                    // The prober steps down too, without a switch at the failed rate
+                    rate_mask &= ~(1 << rate);
+                    set_rate(lower_rate());
+                }
+            }
+            break;
+        case LINK_RATE_KEEPALIVE:
+            if (payload[0] == 1) {
+                uint8_t answer = 0;
+                send_link(LINK_RATE_KEEPALIVE, &answer, 1, source_address);
+            }
+            break;
+        case LINK_RATE_RESULT:
+            #ifdef DEBUG_DLL_STEPS
+                put_str("Probe result: "); put_uint8(payload[0]); put_ch('/'); put_uint8(RATE_PROBE_FRAMES); put_str("\r\n");
+            #endif
+            rate_result_pending = false;
+            if (payload[0] >= RATE_PROBE_THRESHOLD) {
+                rate_negotiated = true;
+                #ifdef DEBUG_DLL
+                    put_str("Link rate negotiated: "); put_uint8(rate); put_str("\r\n");
+                #endif
+            } else {
+                // Rule out this rate and try the next lowest common rate. The
+                // peer has already moved there, so the switch is not sent at
+                // the failed rate.
+                rate_mask &= ~(1 << rate);
+                uint8_t new_rate = lower_rate();
+                set_rate(new_rate);
+                probe_rate(new_rate);
+            }
+            break;
+        #endif
+        #ifdef DLL_DEDUP
+        case LINK_SEQUENCE_RESET: {
+            // The source restarted, its old sequence numbers mean nothing now.
+            // The entry stays with it, so it does not take another source's.
+            Dedup* window = find_dedup(source_address);
+            if (window != NULL) {
+                window->latest = payload[0];
+                window->delivered = 0;
+            }
+            break;
+        }
+        #endif
+        #ifdef DLL_LINK_QUALITY
+        case LINK_ECHO_REQUEST:
+            send_link(LINK_ECHO_REPLY, payload, 4, source_address);
+            break;
+        case LINK_ECHO_REPLY: {
+            LinkQuality* link = find_quality(source_address, true);
+            uint32_t sent = ((uint32_t) payload[0] << 24) | ((uint32_t) payload[1] << 16) | ((uint32_t) payload[2] << 8) | payload[3];
+            link->echo_pending = false;
+            update_rtt(link, get_cycles() - sent);
+            #ifdef DEBUG_DLL_STEPS
+                put_str("Echo reply received, smoothed RTT: "); put_uint16((uint16_t) (link->srtt / (CYCLES_PER_MS / 1000))); put_str(" us\r\n");
+            #endif
+            break;
+        }
+        #endif
+    }
+}
+
+#ifdef DLL_LINK_QUALITY
+// Sends an echo request to measure the round trip time to the peer
+void DLL::probe_link(uint8_t peer_address) {
+    LinkQuality* link = find_quality(peer_address, true);
+    if (link->echo_pending == true) {
+        // Previous request or its reply was lost
+        sample_error(link, true);
+    }
+    // Set before sending, the reply may arrive before send_link() returns
+    link->echo_pending = true;
+    uint32_t now = get_cycles();
+    uint8_t payload[4] = {(uint8_t) (now >> 24), (uint8_t) (now >> 16), (uint8_t) (now >> 8), (uint8_t) now};
+    send_link(LINK_ECHO_REQUEST, payload, 4, peer_address);
+}
+
+// Returns NULL if nothing has been heard from the peer
+const LinkQuality* DLL::link_quality(uint8_t peer_address) {
+    return find_quality(peer_address, false);
+}
+
+LinkQuality* DLL::find_quality(uint8_t peer_address, bool add) {
+    for (uint8_t i = 0; i < QUALITY_PEERS; i++) {
+        if (quality[i].used == true and quality[i].peer == peer_address) {
+            return &quality[i];
+        }
+    }
+    if (add == false) {
+        return NULL;
+    }
+    // Forget the peer that was added longest ago
+    LinkQuality* link = &quality[quality_next];
+    quality_next = (quality_next + 1) % QUALITY_PEERS;
+    link->peer = peer_address;
+    link->used = true;
+    link->echo_pending = false;
+    link->srtt = 0;
+    link->rttvar = 0;
+    link->error_rate = 0;
+    link->frame_length = 0;
+    link->fragment_length = MAX_PACKET_LENGTH;
+    return link;
+}
+
+// Records whether the received frame passed its CRC check. Corrupted frames
+// are only counted against peers already known, their source may be wrong.
+void DLL::count_quality(bool error, uint8_t frame_length) {
+    LinkQuality* link = find_quality(frame.addressing[0], not error);
+    if (link == NULL) {
+        return;
+    }
+    if (link->frame_length == 0) {
+        link->frame_length = frame_length;
+    } else {
+        link->frame_length += ((int16_t) frame_length - link->frame_length) / 8;
+    }
+    sample_error(link, error);
+}
+
+void DLL::sample_error(LinkQuality* link, bool error) {
+    uint32_t error_rate = link->error_rate - (link->error_rate >> ERROR_RATE_SHIFT);
+    if (error == true) {
+        error_rate += 65536UL >> ERROR_RATE_SHIFT;
+    }
+    link->error_rate = error_rate > 0xFFFF ? 0xFFFF : error_rate;
+    update_fragment_length(link);
+}
+
+// Jacobson's estimator: gains of 1/8 for the mean and 1/4 for the variation
+void DLL::update_rtt(LinkQuality* link, uint32_t rtt) {
+    if (rtt == 0) {
+        rtt = 1;
+    }
+    if (link->srtt == 0) {
+        link->srtt = rtt;
+        link->rttvar = rtt / 2;
+        return;
+    }
+    uint32_t delta = rtt > link->srtt ? rtt - link->srtt : link->srtt - rtt;
+    link->rttvar = link->rttvar - link->rttvar / 4 + delta / 4;
+    link->srtt = link->srtt - link->srtt / 8 + rtt / 8;
+}
+
+uint32_t integer_sqrt(uint32_t x) {
+    uint32_t root = 0;
+    for (uint32_t bit = 1UL << 30; bit > 0; bit >>= 2) {
+        if (x >= root + bit) {
+            x -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+    }
+    return root;
+}
+
+// With H overhead bytes per frame, goodput n/(n+H)*(1-ber)^(8(n+H)) peaks at
+// n = (sqrt(H^2 + 4HL/f) - H)/2, using f ~ 8L*ber for the error rate f of
+// frames L bytes long
+void DLL::update_fragment_length(LinkQuality* link) {
+    if (link->error_rate == 0 or link->frame_length == 0) {
+        link->fragment_length = MAX_PACKET_LENGTH;
+        return;
+    }
+    uint32_t x = ((4UL * FRAME_OVERHEAD * link->frame_length) << 16) / link->error_rate;
+    uint32_t n = (integer_sqrt(x + FRAME_OVERHEAD * FRAME_OVERHEAD) - FRAME_OVERHEAD) / 2;
+    if (n < MIN_FRAGMENT_LENGTH) {
+        n = MIN_FRAGMENT_LENGTH;
+    } else if (n > MAX_PACKET_LENGTH) {
+        n = MAX_PACKET_LENGTH;
+    }
+    link->fragment_length = n;
+}
+#endif
+
+// Allows the sender a retransmission timeout, RTT plus four deviations, per
+// frame. The RTT comes from short echo frames, so add the longest frame.
+uint32_t DLL::reassembly_timeout() {
+    #ifdef DLL_LINK_QUALITY
+        LinkQuality* link = find_quality(reconstructed_source, false);
+        if (link != NULL and link->srtt != 0) {
+            return link->srtt + 4 * link->rttvar + MAX_FRAME_TIME;
+        }
+    #endif
+    return REASSEMBLY_TIMEOUT;
+}
+
+uint8_t DLL::fragment_length(uint8_t destination_address) {
+    #ifdef DLL_LINK_QUALITY
+        LinkQuality* link = find_quality(destination_address, false);
+        if (link != NULL) {
+            return link->fragment_length;
+        }
+    #endif
+    return MAX_PACKET_LENGTH;
+}
+
+#ifdef DLL_RATE_NEGOTIATION
+// Advertises the supported rates to the peer, which answers with the rates both ends support
+void DLL::negotiate_rate(uint8_t peer_address) {
+    #ifdef DEBUG_DLL
+        put_str("\r\nNEGOTIATING LINK RATE\r\n");
+    #endif
+    rate_peer = peer_address;
+    rate_negotiated = false;
+    uint8_t mask = SUPPORTED_RATES;
+    send_link(LINK_RATE_OFFER, &mask, 1, rate_peer);
+}
+
+// Returns to the base rate, e.g. when the peer stops answering at a higher
+// rate. poll() calls it for both ends when the link goes quiet.
+void DLL::fallback_rate() {
+    #ifdef DEBUG_DLL
+        put_str("Falling back to base rate\r\n");
+    #endif
+    set_rate(BASE_RATE);
+    rate_mask = SUPPORTED_RATES;
+    rate_negotiated = false;
+    rate_result_pending = false;
+}
+
+// Highest rate left in rate_mask below the current one
+uint8_t DLL::lower_rate() {
+    uint8_t new_rate = rate - 1;
+    while (new_rate > BASE_RATE and not (rate_mask & (1 << new_rate))) {
+        new_rate--;
+    }
+    return new_rate;
+}
+
+// Switches both ends to a new rate and sends a burst of probe frames at it
+void DLL::probe_rate(uint8_t new_rate) {
+    send_link(LINK_RATE_SWITCH, &new_rate, 1, rate_peer);
+    set_rate(new_rate);
+    if (new_rate == BASE_RATE) {
+        rate_negotiated = true;
+        return;
+    }
+    // Pattern exercises byte stuffing and alternating bit patterns
+    const uint8_t pattern[] = {FLAG, ESC, 0x00, 0xFF, 0x55, 0xAA};
+    uint8_t probe[MAX_PACKET_LENGTH];
+    for (uint8_t i = 0; i < MAX_PACKET_LENGTH; i++) {
+        probe[i] = pattern[i % sizeof(pattern)];
+    }
+    if (MAX_PACKET_LENGTH > 1) {
+        probe[1] = RATE_PROBE_FRAMES;
+    }
+    rate_result_pending = true;
+    rate_probe_time = get_cycles();
+    for (uint8_t i = 0; i < RATE_PROBE_FRAMES; i++) {
+        probe[0] = i;
+        send_link(LINK_RATE_PROBE, probe, MAX_PACKET_LENGTH, rate_peer);
+    }
+}
+
+void DLL::set_rate(uint8_t new_rate) {
+    #ifdef DEBUG_DLL_STEPS
+        put_str("Setting link rate: "); put_uint8(new_rate); put_str("\r\n");
+    #endif
+    rate = new_rate;
+    rate_valid_time = get_cycles();
+    // The loopback test has no line to retime, UART0 is its console
+    #ifndef DLL_TEST
+        phy->set_rate(rate);
+    #endif
+}
+
+// Tracks the CRC failure rate and steps the link rate down when it exceeds the threshold
+void DLL::count_frame(bool error) {
+    window_frames++;
+    if (error == false) {
+        rate_valid_time = get_cycles();
+    }
+    if (error == true) {
+        window_errors++;
+        if (window_errors > RATE_ERROR_THRESHOLD and rate > BASE_RATE) {
+            #ifdef DEBUG_DLL
+                put_str("Error rate exceeded, stepping link rate down\r\n");
+            #endif
+            window_frames = 0;
+            window_errors = 0;
+            rate_mask &= ~(1 << rate);
+            uint8_t new_rate = lower_rate();
+            for (uint8_t i = 0; i < RATE_SWITCH_REPEATS; i++) {
+                send_link(LINK_RATE_SWITCH, &new_rate, 1, rate_peer);
+            }
+            set_rate(new_rate);
+            return;
+        }
+    }
+    if (window_frames == RATE_ERROR_WINDOW) {
+        window_frames = 0;
+        window_errors = 0;
+    }
+}
+#endif
+
 Frame::Frame() {
     header = FLAG;
     length = 0;
@@ -395,7 +1243,8 @@ Frame::Frame() {
     footer = FLAG;
 }
 
-DLL::DLL() {
+DLL::DLL(uint8_t address) {
+    this->address = address;
     stuffed_frame = NULL;
     stuffed_frame_length = 0;
     reconstructed_packet = NULL;
@@ -403,10 +1252,60 @@ DLL::DLL() {
     #ifdef DLL_TEST
         received_packet = NULL;
         received_packet_length = 0;
+        lose_frame = 0;
+    #else
+        phy = NULL;
+        net = NULL;
+    #endif
+    for (uint8_t reason = 0; reason < NUM_DROP_REASONS; reason++) {
+        drops[reason] = 0;
+    }
+    reconstructed_source = 0;
+    reconstructed_sequence = 0;
+    reconstructed_last_frame = 0;
+    reconstructed_fragment_length = 0;
+    reconstructed_missing = 0;
+    reconstructed_end = 0;
+    reconstructed_time = 0;
+    next_sequence = 0;
+    last_sequence = 0xFF;
+    last_destination = 0;
+    last_fragment_length = MAX_PACKET_LENGTH;
+    #ifdef DLL_LINK_QUALITY
+        for (uint8_t i = 0; i < QUALITY_PEERS; i++) {
+            quality[i].used = false;
+        }
+        quality_next = 0;
+    #endif
+    #ifdef DLL_DEDUP
+        for (uint8_t i = 0; i < DEDUP_SOURCES; i++) {
+            dedup[i].used = false;
+            dedup[i].delivered = 0;
+        }
+        dedup_next = 0;
+    #endif
+    #ifdef DLL_RATE_NEGOTIATION
+        rate = BASE_RATE;
+        rate_mask = SUPPORTED_RATES;
+        rate_peer = 0xFF;
+        rate_negotiated = false;
+        probe_good = 0;
+        window_frames = 0;
+        window_errors = 0;
+        rate_valid_time = 0;
+        rate_probe_time = 0;
+        rate_keepalive_time = 0;
+        rate_result_pending = false;
     #endif
-    split_packet_error = false;
 }
 
+#ifndef DLL_TEST
+void DLL::connect(PHY* phy, NET* net) {
+    this->phy = phy;
+    this->net = net;
+}
+#endif
+
 uint8_t max(uint8_t a, uint8_t b) {
     if (a > b) {
         return a;
@@ -417,16 +1316,16 @@ uint8_t max(uint8_t a, uint8_t b) {
 
 void print(Frame frame) {    
     /*
-    +--------+-----------+------------+--------+---------------------+------------+--------+
-    | Header |  Control  | Addressing | Length |      NET Packet     |  Checksum  | Footer |
-    +--------+-----------+------------+--------+---------------------+------------+--------+
-    |  0x7d  | 0x7d 0x7e | 0x7d  0x7e |  0x04  | 0x7d 0x7e 0x7d 0x7e | 0x7d  0x7e |  0x7d  |
-    +--------+-----------+------------+--------+---------------------+------------+--------+
+    +--------+-----------+------------+----------+--------+---------------------+------------+--------+
+    | Header |  Control  | Addressing | Sequence | Length |      NET Packet     |  Checksum  | Footer |
+    +--------+-----------+------------+----------+--------+---------------------+------------+--------+
+    |  0x7d  | 0x7d 0x7e | 0x7d  0x7e |   0x7d   |  0x04  | 0x7d 0x7e 0x7d 0x7e | 0x7d  0x7e |  0x7d  |
+    +--------+-----------+------------+----------+--------+---------------------+------------+--------+
     */
     uint8_t num_dashes = max(12, 1 + frame.length*5);
     uint8_t num_spaces = num_dashes - 10;
     uint8_t extra_space = num_dashes % 2;
-    put_str("+--------+-----------+------------+--------+");
+    put_str("+--------+-----------+------------+----------+--------+");
     if (frame.length > 0) {
         for (uint8_t i = 0; i < num_dashes; i++) {
             put_ch('-');
@@ -434,7 +1333,7 @@ void print(Frame frame) {
         put_ch('+');
     }
     put_str("------------+--------+\r\n");
-    put_str("| Header |  Control  | Addressing | Length |");
+    put_str("| Header |  Control  | Addressing | Sequence | Length |");
     if (frame.length > 0) {
         for (uint8_t i = 0; i < num_spaces/2 + extra_space; i++) {
             put_ch(' ');
@@ -446,7 +1345,7 @@ void print(Frame frame) {
         put_ch('|');
     }
     put_str("  Checksum  | Footer |\r\n");
-    put_str("+--------+-----------+------------+--------+");
+    put_str("+--------+-----------+------------+----------+--------+");
     if (frame.length > 0) {
         for (uint8_t i = 0; i < num_dashes; i++) {
             put_ch('-');
@@ -464,7 +1363,9 @@ void print(Frame frame) {
     put_hex(frame.addressing[0]);
     put_str("  ");
     put_hex(frame.addressing[1]);
-    put_str(" |  ");
+    put_str(" |   ");
+    put_hex(frame.sequence);
+    put_str("   |  ");
     put_hex(frame.length);
     put_str("  | ");
     if (frame.length > 2) {
@@ -489,7 +1390,7 @@ void print(Frame frame) {
     put_str(" |  ");
     put_hex(frame.footer);
     put_str("  |\r\n");
-    put_str("+--------+-----------+------------+--------+");
+    put_str("+--------+-----------+------------+----------+--------+");
     if (frame.length > 0) {
         for (uint8_t i = 0; i < num_dashes; i++) {
             put_ch('-');
@@ -1,17 +1,105 @@
 #pragma once
 #include <stdint.h>
 #include "config.hpp"
+#include "timer.hpp"
 
 #define FLAG 0x7D
 #define ESC  0x7E
 #define MAC_ADDRESS 0
-#define MAX_PACKET_LENGTH 8
+// Stuffed frames must fit in 255 bytes, so at most 118
+#ifndef MAX_PACKET_LENGTH
+    #define MAX_PACKET_LENGTH 8
+#endif
 #define POLYNOMIAL 65521
+// Largest stuffed frame: both FLAGs plus every header, packet and checksum byte escaped
+#define MAX_STUFFED_FRAME_LENGTH (2 + 2 * (6 + MAX_PACKET_LENGTH + 2))
+// Largest packet NET can hand down, packet lengths are 8 bit
+#define MAX_NET_PACKET_LENGTH 255
+
+// Reasons received frames are dropped, counted per DLL and stored in captures
+#define DROP_NONE        0
+#define DROP_ADDRESS     1 // destination address does not match
+#define DROP_CRC         2 // CRC check failed
+#define DROP_SPLIT       3 // frame does not fit the split packet being reassembled
+#define DROP_DECOMPRESS  4 // packet failed to decompress, or compression is not built in
+#define DROP_FORMAT      5 // frame length or number does not match its header
+#define DROP_DUPLICATE   6 // packet or split packet frame was already received
+#define DROP_TIMEOUT     7 // split packets given up on with frames missing
+#define DROP_MEMORY      8 // no memory left for the frame or packet
+#define NUM_DROP_REASONS 9
+
+// control[1] holds the last frame number of the packet and these flags
+#define CONTROL_LAST_FRAME 0x3F
+#define CONTROL_COMPRESSED 0x40 // packet was compressed before being split
+
+// Link control frames have CONTROL_LINK set in control[1] and an opcode in control[0]
+#define CONTROL_LINK 0x80
+#define LINK_RATE_OFFER  0x01 // payload: supported rate mask
+#define LINK_RATE_ACCEPT 0x02 // payload: common rate mask
+#define LINK_RATE_SWITCH 0x03 // payload: rate index
+#define LINK_RATE_PROBE  0x04 // payload: probe number, probe count, test pattern
+#define LINK_RATE_RESULT 0x05 // payload: number of probes received with a valid CRC
+#define LINK_ECHO_REQUEST 0x06 // payload: 4 byte send time
+#define LINK_ECHO_REPLY   0x07 // payload: send time from the request
+#define LINK_SEQUENCE_RESET 0x08 // payload: next sequence number, the sender restarted
+#define LINK_RATE_KEEPALIVE 0x09 // payload: 1 if the peer should answer, keeps a quiet link at its rate
+
+// Rate negotiation (rate indices refer to the table in uart.c)
+#define NUM_RATES 8
+#define BASE_RATE 0
+#ifdef HOST_TOOL
+    // Serial ports on the host can not do 250000 or 750000 baud
+    #define SUPPORTED_RATES 0x5F
+#else
+    #define SUPPORTED_RATES 0xFF
+#endif
+#define RATE_PROBE_FRAMES 8
+#define RATE_PROBE_THRESHOLD 8 // probes that must pass to accept a rate
+#define RATE_ERROR_WINDOW 32 // frames per error rate measurement
+#define RATE_ERROR_THRESHOLD 4 // CRC failures per window before falling back
+#define RATE_FALLBACK_TIMEOUT (2000 * CYCLES_PER_MS) // back to the base rate after this long without a valid frame
+#define RATE_RESULT_TIMEOUT (200 * CYCLES_PER_MS) // wait for a probe result before falling back
+#define RATE_KEEPALIVE_TIME (RATE_FALLBACK_TIMEOUT / 4) // quiet time before a keepalive, and between them
+#define RATE_SWITCH_REPEATS 3 // step down switches go out at the failing rate, the only one the peer hears
+
+// Duplicate suppression remembers the last DEDUP_WINDOW sequence numbers
+// delivered from each of the last DEDUP_SOURCES sources. A source that
+// restarts announces it with LINK_SEQUENCE_RESET, if that is lost new
+// packets that fall in its old window are dropped until the window moves on.
+#define DEDUP_SOURCES 4
+#define DEDUP_WINDOW 16 // bits in Dedup::delivered
+
+// Link quality estimation, times are get_cycles() counts
+#define QUALITY_PEERS 4
+#define ERROR_RATE_SHIFT 5 // error rate moving average weight, 1/32
+#define FRAME_OVERHEAD 10 // flags, header and CRC bytes per frame
+#define MIN_FRAGMENT_LENGTH 4 // keeps the last frame number within CONTROL_LAST_FRAME
+#define REASSEMBLY_TIMEOUT (1000 * CYCLES_PER_MS) // without a measured round trip time to the peer
+#define MAX_FRAME_TIME (MAX_STUFFED_FRAME_LENGTH * 25 * CYCLES_PER_MS / 24) // longest frame at 9600 baud, the base rate
+
+struct LinkQuality {
+    uint8_t peer;
+    bool used;
+    bool echo_pending;
+    uint32_t srtt; // smoothed round trip time, 0 until measured
+    uint32_t rttvar; // round trip time variation
+    uint16_t error_rate; // fraction of frames lost or corrupted, in 1/65536ths
+    uint8_t frame_length; // average stuffed length of frames received
+    uint8_t fragment_length; // NET bytes per frame sent to the peer
+};
+
+struct Dedup {
+    bool used;
+    uint8_t source;
+    uint8_t latest; // newest sequence number delivered
+    uint16_t delivered; // bit n set if latest - n was delivered, 0 if none yet
+};
 
 struct Frame {
     uint8_t header;
     uint8_t control[2];
     uint8_t addressing[2];
+    uint8_t sequence; // shared by every frame of a packet
     uint8_t length;
     uint8_t* net_packet;
     uint8_t checksum[2];
@@ -19,31 +107,129 @@ struct Frame {
     Frame();
 };
 
+#ifndef DLL_TEST
+// Layers either side of the DLL
+class PHY {
+public:
+    virtual void send(uint8_t* frame, uint8_t frame_length) = 0;
+    virtual void set_rate(uint8_t rate) {} // AVR PHYs on UART0 call set_uart0_rate()
+    virtual ~PHY() {}
+};
+
+class NET {
+public:
+    virtual void receive(uint8_t* packet, uint8_t packet_length, uint8_t source_address) = 0;
+    virtual ~NET() {}
+};
+#endif
+
 class DLL {
 #ifdef DLL_TEST
     public:
 #else
     private:
 #endif
+    uint8_t address;
     Frame frame;
     uint8_t* stuffed_frame;
     uint8_t stuffed_frame_length;
     uint8_t* reconstructed_packet;
     uint8_t reconstructed_packet_length;
-    void byte_stuff();
-    void de_byte_stuff();
+    uint8_t reconstructed_source;
+    uint8_t reconstructed_sequence;
+    uint8_t reconstructed_last_frame;
+    uint8_t reconstructed_fragment_length; // NET bytes in every frame but the last
+    uint64_t reconstructed_missing; // bit n set until frame n arrives
+    uint8_t reconstructed_end; // packet length, once the last frame arrives
+    uint32_t reconstructed_time; // when the last frame arrived
+    uint32_t reassembly_timeout();
+    void transmit();
+    void process(uint8_t* frame, uint8_t frame_length);
+    void abandon_reassembly();
+    void deliver(uint8_t* packet, uint8_t packet_length, bool compressed);
+    bool byte_stuff();
+    uint8_t de_byte_stuff();
     uint16_t calculate_crc();
     bool check_crc();
-    bool split_packet_error;
+    uint16_t drops[NUM_DROP_REASONS];
+    void drop(uint8_t reason);
+    void count_drop(uint8_t reason);
+    void drop_unsent(uint8_t reason);
+    uint8_t next_sequence;
+    uint8_t last_sequence; // packet sent most recently, and how it was split
+    uint8_t last_destination;
+    uint8_t last_fragment_length;
+    void send_link(uint8_t opcode, uint8_t* payload, uint8_t payload_length, uint8_t destination_address);
+    void receive_link();
+    #ifdef DLL_LINK_QUALITY
+        LinkQuality quality[QUALITY_PEERS];
+        uint8_t quality_next; // entry to reuse for a new peer
+        LinkQuality* find_quality(uint8_t peer_address, bool add);
+        void count_quality(bool error, uint8_t frame_length);
+        void sample_error(LinkQuality* link, bool error);
+        void update_rtt(LinkQuality* link, uint32_t rtt);
+        void update_fragment_length(LinkQuality* link);
+    #endif
+    uint8_t fragment_length(uint8_t destination_address);
+    #ifdef DLL_DEDUP
+        Dedup dedup[DEDUP_SOURCES];
+        uint8_t dedup_next; // entry to reuse for a new source
+        Dedup* find_dedup(uint8_t source_address);
+        bool duplicate();
+        void mark_delivered();
+    #endif
+    #ifdef DLL_RATE_NEGOTIATION
+        uint8_t rate;
+        uint8_t rate_mask;
+        uint8_t rate_peer;
+        bool rate_negotiated;
+        uint8_t probe_good;
+        uint8_t window_frames;
+        uint8_t window_errors;
+        uint32_t rate_valid_time; // when the last valid frame arrived
+        uint32_t rate_probe_time; // when the last probe burst was sent
+        uint32_t rate_keepalive_time; // when the last keepalive was sent
+        bool rate_result_pending;
+        void count_frame(bool error);
+        void set_rate(uint8_t new_rate);
+        void probe_rate(uint8_t new_rate);
+        uint8_t lower_rate();
+    #endif
     #ifdef DLL_TEST
         uint8_t* received_packet;
         uint8_t received_packet_length;
+        uint8_t lose_frame; // frame of the next split packet the loopback loses, 0 for none
+    #else
+        PHY* phy;
+        NET* net;
     #endif
 public:
-    DLL();
-    void send(uint8_t* packet, uint8_t packet_length, uint8_t destination_address);
+    DLL(uint8_t address = MAC_ADDRESS);
+    uint16_t drop_count(uint8_t reason);
+    uint8_t decode(uint8_t* frame, uint8_t frame_length, Frame& decoded);
+    #ifndef DLL_TEST
+        void connect(PHY* phy, NET* net);
+    #endif
+    uint8_t send(uint8_t* packet, uint8_t packet_length, uint8_t destination_address);
+    void resend(uint8_t* packet, uint8_t packet_length, uint8_t destination_address, uint8_t sequence);
     void receive(uint8_t* frame, uint8_t frame_length);
+    void poll();
+    #ifdef DLL_RATE_NEGOTIATION
+        void negotiate_rate(uint8_t peer_address);
+        void fallback_rate();
+    #endif
+    #ifdef DLL_LINK_QUALITY
+        void probe_link(uint8_t peer_address);
+        const LinkQuality* link_quality(uint8_t peer_address);
+    #endif
+    #ifdef DLL_DEDUP
+        void announce_restart();
+    #endif
 };
 
+// Duplicate suppression window, shared with the offline decoder
+bool dedup_seen(const Dedup& window, uint8_t sequence);
+void dedup_mark(Dedup& window, uint8_t sequence);
+
 void print(Frame);
 void print(uint8_t* buffer, uint8_t buffer_length);
\ No newline at end of file
@@ -0,0 +1,60 @@
+#include "framer.hpp"
+
+Framer::Framer() {
+    errors = 0;
+    reset();
+}
+
+void Framer::reset() {
+    frame_length = 0;
+    escaped = false;
+    complete = false;
+}
+
+// Returns true when frame holds a complete stuffed frame, valid until the next push
+bool Framer::push(uint8_t byte) {
+    if (complete) {
+        reset();
+    }
+    if (frame_length == 0) {
+        // Wait for the opening flag
+        if (byte == FLAG) {
+            frame[frame_length++] = byte;
+        }
+        return false;
+    }
+    if (frame_length == MAX_STUFFED_FRAME_LENGTH) {
+        // Lost a flag, resynchronise on the next one
+        errors++;
+        reset();
+        if (byte == FLAG) {
+            frame[frame_length++] = byte;
+        }
+        return false;
+    }
+    if (escaped) {
+        frame[frame_length++] = byte;
+        escaped = false;
+    } else if (byte == ESC) {
+        frame[frame_length++] = byte;
+        escaped = true;
+    } else if (byte == FLAG) {
+        // Back to back flags, the second one opens the frame
+        if (frame_length == 1) {
+            return false;
+        }
+        frame[frame_length++] = byte;
+        if (frame_length < MIN_STUFFED_FRAME_LENGTH) {
+            // Too short to be a frame, the flag may open the next one
+            errors++;
+            reset();
+            frame[frame_length++] = byte;
+            return false;
+        }
+        complete = true;
+        return true;
+    } else {
+        frame[frame_length++] = byte;
+    }
+    return false;
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <stdint.h>
+#include "dll.hpp"
+
+#define MIN_STUFFED_FRAME_LENGTH (2 + 6 + 2)
+
+// Splits a byte stream into stuffed frames, ESC protects a following FLAG or ESC
+class Framer {
+public:
+    uint8_t frame[MAX_STUFFED_FRAME_LENGTH];
+    uint16_t frame_length;
+    uint32_t errors; // frames that were too long or too short
+    Framer();
+    bool push(uint8_t byte);
+    void reset();
+private:
+    bool escaped;
+    bool complete;
+};
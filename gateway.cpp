@@ -0,0 +1,423 @@
+// Host tool: terminates many serial links, each with its own DLL
+//
+// Usage: gateway [-w workers] [-p ptys] [-v] [device...]
+//
+// The main thread reads every device through one epoll loop and splits the
+// byte streams into stuffed frames. Frames are handed to a pool of worker
+// threads sharded by link, so each DLL is only ever used by one thread.
+// Received packets are counted (and printed with -v). Lines on stdin of the
+// form "<link> <destination> <hex bytes>" send a packet down a link.
+// -p opens pseudo-terminals for testing and prints their slave devices.
+// A link that hangs up (e.g. its pseudo-terminal slave closes) leaves the
+// epoll set and is tried again every second, when every DLL is also polled.
+#include "dll.hpp"
+#include "framer.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define READ_BUFFER_SIZE 4096
+#define TICK_MS 1000 // statistics and hung up links
+
+std::mutex output_mutex;
+bool verbose = false;
+volatile sig_atomic_t running = 1;
+
+// termios speeds indexed by DLL rate, 0 where the host can not do the rate
+const speed_t rate_speeds[NUM_RATES] = {B9600, B19200, B38400, B57600, B115200, 0, B500000, 0};
+
+class Link : public PHY, public NET {
+public:
+    uint16_t id;
+    int fd;
+    DLL dll;
+    Framer framer; // only used by the epoll thread
+    bool hung_up;  // only used by the epoll thread
+    // Statistics
+    std::atomic<uint32_t> frames;
+    std::atomic<uint32_t> packets;
+    std::atomic<uint32_t> packet_bytes;
+
+    Link(uint16_t id, int fd) : id(id), fd(fd), hung_up(false), frames(0), packets(0), packet_bytes(0) {
+        dll.connect(this, this);
+    }
+
+    // PHY: called by the DLL on this link's worker thread
+    void send(uint8_t* frame, uint8_t frame_length) {
+        uint8_t sent = 0;
+        while (sent < frame_length) {
+            ssize_t written = write(fd, &frame[sent], frame_length - sent);
+            if (written > 0) {
+                sent += written;
+            } else if (written < 0 and errno == EAGAIN) {
+                pollfd out = {fd, POLLOUT, 0};
+                poll(&out, 1, 100);
+            } else if (written < 0 and errno != EINTR) {
+                return;
+            }
+        }
+    }
+
+    void set_rate(uint8_t rate) {
+        if (rate_speeds[rate] == 0) {
+            return;
+        }
+        // Let the frame announcing the switch leave at the old rate
+        tcdrain(fd);
+        termios settings;
+        if (tcgetattr(fd, &settings) == 0) {
+            cfsetspeed(&settings, rate_speeds[rate]);
+            tcsetattr(fd, TCSANOW, &settings);
+        }
+    }
+
+    // NET: called by the DLL on this link's worker thread
+    void receive(uint8_t* packet, uint8_t packet_length, uint8_t source_address) {
+        packets++;
+        packet_bytes += packet_length;
+        if (verbose) {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            printf("link %u from 0x%02X:", id, source_address);
+            for (uint8_t i = 0; i < packet_length; i++) {
+                printf(" %02X", packet[i]);
+            }
+            printf("\n");
+        }
+    }
+};
+
+enum JobType {
+    JOB_RECEIVE, // a frame from the link
+    JOB_SEND, // a packet from stdin
+    JOB_POLL // run the DLL's timers
+};
+
+struct Job {
+    Link* link;
+    JobType type;
+    uint8_t destination_address;
+    std::vector<uint8_t> data;
+};
+
+class Worker {
+public:
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<Job> jobs;
+    bool stopping;
+    std::thread thread;
+
+    Worker() : stopping(false) {
+        thread = std::thread(&Worker::run, this);
+    }
+
+    void push(std::vector<Job>& batch) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (Job& job : batch) {
+                jobs.push_back(std::move(job));
+            }
+        }
+        batch.clear();
+        ready.notify_one();
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_one();
+        thread.join();
+    }
+
+    void run() {
+        std::deque<Job> batch;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock, [this] { return stopping or not jobs.empty(); });
+                if (jobs.empty()) {
+                    return;
+                }
+                batch.swap(jobs);
+            }
+            for (Job& job : batch) {
+                if (job.type == JOB_SEND) {
+                    job.link->dll.send(job.data.data(), job.data.size(), job.destination_address);
+                } else if (job.type == JOB_RECEIVE) {
+                    job.link->dll.receive(job.data.data(), job.data.size());
+                } else {
+                    job.link->dll.poll();
+                }
+            }
+            batch.clear();
+        }
+    }
+};
+
+int open_link(const char* path) {
+    int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    return fd;
+}
+
+int open_pty() {
+    int fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0 or grantpt(fd) != 0 or unlockpt(fd) != 0) {
+        perror("posix_openpt");
+        return -1;
+    }
+    return fd;
+}
+
+// Raw 8N1 at the base rate
+void configure_link(int fd) {
+    termios settings;
+    if (tcgetattr(fd, &settings) != 0) {
+        return;
+    }
+    cfmakeraw(&settings);
+    cfsetspeed(&settings, rate_speeds[BASE_RATE]);
+    tcsetattr(fd, TCSANOW, &settings);
+}
+
+void deframe(Link& link, uint8_t* bytes, ssize_t length, std::vector<Job>& batch) {
+    for (ssize_t i = 0; i < length; i++) {
+        if (link.framer.push(bytes[i])) {
+            link.frames++;
+            batch.push_back(Job{&link, JOB_RECEIVE, 0, std::vector<uint8_t>(link.framer.frame, link.framer.frame + link.framer.frame_length)});
+        }
+    }
+}
+
+// Parses "<link> <destination> <hex bytes>"
+bool parse_command(char* line, std::vector<Link*>& links, Job& job) {
+    char* next;
+    unsigned long id = strtoul(line, &next, 0);
+    if (next == line or id >= links.size()) {
+        return false;
+    }
+    line = next;
+    unsigned long destination = strtoul(line, &next, 0);
+    if (next == line or destination > 0xFF) {
+        return false;
+    }
+    line = next;
+    job.link = links[id];
+    job.type = JOB_SEND;
+    job.destination_address = destination;
+    while (true) {
+        unsigned long byte = strtoul(line, &next, 16);
+        if (next == line) {
+            break;
+        }
+        if (byte > 0xFF or job.data.size() == 255) {
+            return false;
+        }
+        job.data.push_back(byte);
+        line = next;
+    }
+    return not job.data.empty();
+}
+
+void print_stats(std::vector<Link*>& links) {
+    uint32_t frames = 0, framing_errors = 0, packets = 0, packet_bytes = 0;
+    for (Link* link : links) {
+        frames += link->frames;
+        framing_errors += link->framer.errors;
+        packets += link->packets;
+        packet_bytes += link->packet_bytes;
+    }
+    std::lock_guard<std::mutex> lock(output_mutex);
+    fprintf(stderr, "%zu links: %u frames, %u framing errors, %u packets, %u packet bytes\n",
+            links.size(), frames, framing_errors, packets, packet_bytes);
+}
+
+// Puts hung up links back in the epoll set, ones still hung up drop out again
+void retry_links(int epoll_fd, std::vector<Link*>& links) {
+    for (Link* link : links) {
+        if (link->hung_up) {
+            epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.ptr = link;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, link->fd, &event) == 0) {
+                link->hung_up = false;
+            }
+        }
+    }
+}
+
+void stop(int) {
+    running = 0;
+}
+
+int main(int argc, char* argv[]) {
+    unsigned num_workers = std::thread::hardware_concurrency();
+    unsigned num_ptys = 0;
+    int option;
+    while ((option = getopt(argc, argv, "w:p:v")) != -1) {
+        switch (option) {
+            case 'w': num_workers = atoi(optarg); break;
+            case 'p': num_ptys = atoi(optarg); break;
+            case 'v': verbose = true; break;
+            default:
+                fprintf(stderr, "Usage: %s [-w workers] [-p ptys] [-v] [device...]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (num_workers == 0) {
+        num_workers = 1;
+    }
+
+    std::vector<Link*> links;
+    for (int i = optind; i < argc; i++) {
+        int fd = open_link(argv[i]);
+        if (fd < 0) {
+            return 1;
+        }
+        links.push_back(new Link(links.size(), fd));
+    }
+    for (unsigned i = 0; i < num_ptys; i++) {
+        int fd = open_pty();
+        if (fd < 0) {
+            return 1;
+        }
+        printf("link %zu: %s\n", links.size(), ptsname(fd));
+        links.push_back(new Link(links.size(), fd));
+    }
+    if (links.empty()) {
+        fprintf(stderr, "No links\n");
+        return 1;
+    }
+    fflush(stdout);
+
+    int epoll_fd = epoll_create1(0);
+    for (Link* link : links) {
+        configure_link(link->fd);
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.ptr = link;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, link->fd, &event);
+        #ifdef DLL_DEDUP
+            // Peers may remember our sequence numbers from a previous run. The
+            // workers have not started, so this thread may use the DLL.
+            link->dll.announce_restart();
+        #endif
+    }
+    epoll_event stdin_event = {};
+    stdin_event.events = EPOLLIN;
+    stdin_event.data.ptr = NULL;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &stdin_event);
+
+    std::vector<Worker*> workers;
+    for (unsigned i = 0; i < num_workers; i++) {
+        workers.push_back(new Worker());
+    }
+    std::vector<std::vector<Job>> batches(num_workers);
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    uint8_t buffer[READ_BUFFER_SIZE];
+    char command[1024];
+    size_t command_length = 0;
+    epoll_event events[64];
+    std::chrono::steady_clock::time_point next_tick = std::chrono::steady_clock::now() + std::chrono::milliseconds(TICK_MS);
+    while (running) {
+        int num_events = epoll_wait(epoll_fd, events, 64, TICK_MS);
+        if (num_events < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        // Ticks on time rather than on an idle timeout, so busy links can not stop it
+        if (std::chrono::steady_clock::now() >= next_tick) {
+            next_tick = std::chrono::steady_clock::now() + std::chrono::milliseconds(TICK_MS);
+            print_stats(links);
+            retry_links(epoll_fd, links);
+            // Expires stalled split packets, on the worker that owns each DLL
+            for (Link* link : links) {
+                batches[link->id % num_workers].push_back(Job{link, JOB_POLL, 0, std::vector<uint8_t>()});
+            }
+        }
+        for (int i = 0; i < num_events; i++) {
+            Link* link = (Link*) events[i].data.ptr;
+            if (link == NULL) {
+                ssize_t length = read(STDIN_FILENO, &command[command_length], sizeof(command) - 1 - command_length);
+                if (length <= 0) {
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+                    continue;
+                }
+                command_length += length;
+                command[command_length] = '\0';
+                char* line = command;
+                char* end;
+                while ((end = strchr(line, '\n')) != NULL) {
+                    *end = '\0';
+                    Job job;
+                    if (parse_command(line, links, job)) {
+                        batches[job.link->id % num_workers].push_back(std::move(job));
+                    } else {
+                        fprintf(stderr, "Usage: <link> <destination> <hex bytes>\n");
+                    }
+                    line = end + 1;
+                }
+                command_length = strlen(line);
+                memmove(command, line, command_length);
+                if (command_length == sizeof(command) - 1) {
+                    command_length = 0;
+                }
+                continue;
+            }
+            ssize_t length;
+            while ((length = read(link->fd, buffer, sizeof(buffer))) > 0) {
+                deframe(*link, buffer, length, batches[link->id % num_workers]);
+            }
+            if ((events[i].events & (EPOLLHUP | EPOLLERR)) or (length < 0 and errno == EIO)) {
+                // Hung up, epoll would report it on every wait until the other end is back
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, link->fd, NULL);
+                link->hung_up = true;
+            } else if (length == 0 or (length < 0 and errno != EAGAIN)) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, link->fd, NULL);
+            }
+        }
+        // One hand over per worker per wakeup
+        for (unsigned i = 0; i < num_workers; i++) {
+            if (not batches[i].empty()) {
+                workers[i]->push(batches[i]);
+            }
+        }
+    }
+
+    for (Worker* worker : workers) {
+        worker->stop();
+        delete worker;
+    }
+    print_stats(links);
+    for (Link* link : links) {
+        close(link->fd);
+        delete link;
+    }
+    close(epoll_fd);
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include "lzss.hpp"
+
+/*
+Compressed format:
++-----------------+-------+--------------+-------+--------------+-----
+| Original length | Flags | Up to 8 items| Flags | Up to 8 items| ...
++-----------------+-------+--------------+-------+--------------+-----
+Bit n of a flags byte is set when item n is a literal byte and cleared when
+it is a match (offset back into the output, length - LZSS_MIN_MATCH).
+The packet itself is the window, so no extra buffers are needed.
+*/
+
+// Returns the compressed length, or 0 if it would not fit in max_length
+uint8_t compress(uint8_t* data, uint8_t data_length, uint8_t* compressed, uint8_t max_length) {
+    if (max_length < 1) {
+        return 0;
+    }
+    uint16_t out = 0;
+    compressed[out++] = data_length;
+    uint16_t flags_index = 0;
+    uint8_t item = 8;
+    uint16_t in = 0;
+    while (in < data_length) {
+        // Start a new group of items
+        if (item == 8) {
+            if (out >= max_length) {
+                return 0;
+            }
+            flags_index = out;
+            compressed[out++] = 0;
+            item = 0;
+        }
+        // Find the longest match in the window
+        uint16_t best_length = 0;
+        uint16_t best_offset = 0;
+        uint16_t start = in > LZSS_WINDOW ? in - LZSS_WINDOW : 0;
+        for (uint16_t match = start; match < in; match++) {
+            uint16_t length = 0;
+            while (in + length < data_length and data[match + length] == data[in + length]) {
+                length++;
+            }
+            if (length > best_length) {
+                best_length = length;
+                best_offset = in - match;
+            }
+        }
+        if (best_length >= LZSS_MIN_MATCH) {
+            if (out + 2 > max_length) {
+                return 0;
+            }
+            compressed[out++] = best_offset;
+            compressed[out++] = best_length - LZSS_MIN_MATCH;
+            in += best_length;
+        } else {
+            if (out + 1 > max_length) {
+                return 0;
+            }
+            compressed[flags_index] |= 1 << item;
+            compressed[out++] = data[in++];
+        }
+        item++;
+    }
+    return out;
+}
+
+// Returns the original length, or 0 if the compressed data is malformed
+uint8_t decompress(uint8_t* compressed, uint8_t compressed_length, uint8_t* data, uint8_t max_length) {
+    if (compressed_length < 1 or compressed[0] > max_length) {
+        return 0;
+    }
+    uint8_t data_length = compressed[0];
+    uint16_t in = 1;
+    uint16_t out = 0;
+    uint8_t flags = 0;
+    uint8_t item = 8;
+    while (out < data_length) {
+        if (item == 8) {
+            if (in >= compressed_length) {
+                return 0;
+            }
+            flags = compressed[in++];
+            item = 0;
+        }
+        if (flags & (1 << item)) {
+            if (in >= compressed_length) {
+                return 0;
+            }
+            data[out++] = compressed[in++];
+        } else {
+            if (in + 2 > compressed_length) {
+                return 0;
+            }
+            uint16_t offset = compressed[in];
+            uint16_t length = compressed[in + 1] + LZSS_MIN_MATCH;
+            in += 2;
+            if (offset == 0 or offset > out or out + length > data_length) {
+                return 0;
+            }
+            // Byte by byte, matches may overlap the bytes they produce
+            for (uint16_t i = 0; i < length; i++) {
+                data[out] = data[out - offset];
+                out++;
+            }
+        }
+        item++;
+    }
+    return data_length;
+}
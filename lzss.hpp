@@ -0,0 +1,10 @@
+#pragma once
+#include <stdint.h>
+
+// Matches are coded as an offset byte and a length byte, so shorter ones are sent as literals
+#define LZSS_MIN_MATCH 3
+// How far back to search for matches, trades compression ratio for CPU time
+#define LZSS_WINDOW 128
+
+uint8_t compress(uint8_t* data, uint8_t data_length, uint8_t* compressed, uint8_t max_length);
+uint8_t decompress(uint8_t* compressed, uint8_t compressed_length, uint8_t* data, uint8_t max_length);
@@ -0,0 +1,95 @@
+#include "mac.hpp"
+#include "timer.hpp"
+#include "config.hpp"
+#include <stdlib.h>
+
+MACStats mac_stats;
+MACReceiver mac_receiver;
+
+void init_mac(uint16_t seed, MACReceiver receiver) {
+    mac_receiver = receiver;
+    init_timer1();
+    // Nodes must not share a seed or they back off in lockstep
+    srand(seed);
+    mac_stats.frames_sent = 0;
+    mac_stats.collisions = 0;
+    mac_stats.frames_dropped = 0;
+}
+
+// Binary exponential backoff: a random number of slots in [0, 2^collisions)
+uint16_t backoff_slots(uint8_t collisions) {
+    if (collisions > MAC_MAX_BACKOFF_EXPONENT) {
+        collisions = MAC_MAX_BACKOFF_EXPONENT;
+    }
+    return rand() % (1 << collisions);
+}
+
+// Extra idle times to wait before an attempt, in [0, MAC_DEFER_SLOTS),
+// so nodes that queued during a transmission do not all start when it ends
+uint16_t defer_slots() {
+    return rand() % MAC_DEFER_SLOTS;
+}
+
+#ifndef WINDOWS
+void wait_cycles(uint32_t cycles) {
+    uint32_t start = get_cycles();
+    while (get_cycles() - start < cycles);
+}
+
+// Carrier sense: wait until nothing has been received for idle_cycles. The
+// bus is only known to be quiet from when we start listening.
+void wait_idle(uint32_t idle_cycles) {
+    uint32_t quiet_since = get_cycles();
+    while (uart0_received() or get_cycles() - quiet_since < idle_cycles) {
+        if (uart0_received()) {
+            // Another node is transmitting. Reading the byte clears RXC0,
+            // the receiver (if any) gets it so its frame is not lost.
+            quiet_since = get_cycles();
+            uint8_t byte = get_ch();
+            if (mac_receiver != NULL) {
+                mac_receiver(byte);
+            }
+        }
+    }
+}
+
+// Sends the frame while reading back each byte, returns false on collision
+bool transmit_frame(uint8_t* frame, uint8_t frame_length, uint16_t bit_cycles) {
+    uart0_driver(true);
+    for (uint8_t i = 0; i < frame_length; i++) {
+        put_ch(frame[i]);
+        // Echo arrives one character (10 bits) later, allow twice that
+        uint32_t start = get_cycles();
+        while (not uart0_received()) {
+            if (get_cycles() - start > 20UL * bit_cycles) {
+                uart0_driver(false);
+                return false;
+            }
+        }
+        if ((uint8_t) get_ch() != frame[i]) {
+            uart0_driver(false);
+            return false;
+        }
+    }
+    uart0_driver(false);
+    return true;
+}
+
+bool mac_send(uint8_t* frame, uint8_t frame_length) {
+    uint16_t bit_cycles = uart0_bit_cycles();
+    for (uint8_t attempt = 1; attempt <= MAC_MAX_ATTEMPTS; attempt++) {
+        wait_idle((uint32_t) (1 + defer_slots()) * MAC_IDLE_BITS * bit_cycles);
+        if (transmit_frame(frame, frame_length, bit_cycles)) {
+            mac_stats.frames_sent++;
+            return true;
+        }
+        #ifdef DEBUG_DLL_STEPS
+            put_str("Collision detected, backing off\r\n");
+        #endif
+        mac_stats.collisions++;
+        wait_cycles((uint32_t) backoff_slots(attempt) * MAC_SLOT_BITS * bit_cycles);
+    }
+    mac_stats.frames_dropped++;
+    return false;
+}
+#endif
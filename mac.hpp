@@ -0,0 +1,31 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Bus must be silent for this many bit times before transmitting (just over one character)
+#define MAC_IDLE_BITS 12
+// Backoff slot length in bit times (two characters)
+#define MAC_SLOT_BITS 20
+// Each attempt then waits a random number of idle times below this, p-persistence
+// that spreads out nodes which queued during the same transmission
+#define MAC_DEFER_SLOTS 8
+// Backoff window stops doubling after this many collisions
+#define MAC_MAX_BACKOFF_EXPONENT 8
+// Frame is dropped after this many collisions
+#define MAC_MAX_ATTEMPTS 12
+
+struct MACStats {
+    uint16_t frames_sent;
+    uint16_t collisions;
+    uint16_t frames_dropped;
+};
+
+extern MACStats mac_stats;
+
+// Takes bytes that arrive while waiting for the bus, e.g. a node's framer
+typedef void (*MACReceiver)(uint8_t byte);
+
+void init_mac(uint16_t seed, MACReceiver receiver = NULL);
+uint16_t backoff_slots(uint8_t collisions);
+uint16_t defer_slots();
+bool mac_send(uint8_t* frame, uint8_t frame_length);
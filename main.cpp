@@ -1,7 +1,12 @@
 #include <stdlib.h>
+#include <string.h>
 #include "dll.hpp"
 #include "mem.hpp"
 #include "config.hpp"
+#include "prof.hpp"
+#include "capture.hpp"
+#include "mac.hpp"
+#include "timer.hpp"
 
 #ifdef DEBUG_MEM_ELABORATE
     #define allocate(x, ...) put_str(#x); put_str(": "); allocate(x, ##__VA_ARGS__)
@@ -14,14 +19,45 @@
 
 bool dll_test(DLL&);
 
+DLL dll; // static so the link-time memory budget counts it
+
 int main() {
     #ifndef WINDOWS
         init_uart0();   // init uart
         _delay_ms(100); // delay for uart to initialize properly
         put_str("--------------------------------------------------------\r\n");
     #endif
+    #ifdef DLL_PROFILE
+        init_profile();
+    #endif
+    #ifdef DLL_CAPTURE
+        init_capture();
+    #endif
+    #ifdef DLL_CSMA
+        init_mac(MAC_ADDRESS);
+    #endif
+    init_timer1();
+    #ifdef DLL_DEDUP
+        // Receivers may remember sequence numbers from before this reset
+        dll.announce_restart();
+    #endif
     // Test DLL
-    DLL dll;
+    #ifdef DLL_RATE_NEGOTIATION
+        dll.negotiate_rate(MAC_ADDRESS);
+        if (dll.rate_negotiated == false) {
+            put_str("Error: Link rate negotiation failed\r\n");
+            return 1;
+        }
+        put_str("Link rate negotiated: "); put_uint8(dll.rate); put_str("\r\n");
+    #endif
+    #ifdef DLL_LINK_QUALITY
+        dll.probe_link(MAC_ADDRESS);
+        const LinkQuality* quality = dll.link_quality(MAC_ADDRESS);
+        if (quality == NULL or quality->echo_pending == true or quality->srtt == 0) {
+            put_str("Error: Link probe not answered\r\n");
+            return 1;
+        }
+    #endif
     for (uint16_t i = 0; i < NUM_TESTS; i++) {
         bool error = dll_test(dll);
         if (error == true) {
@@ -39,12 +75,18 @@ int main() {
             #endif
         }
     }
+    #ifdef DLL_PROFILE
+        print_profile();
+    #endif
+    #ifdef DLL_CAPTURE
+        dump_capture();
+    #endif
 }
 
 bool dll_test(DLL& dll) {
     uint8_t packet_length = rand() % 24 + 1; // 1-24 bytes
     // uint8_t packet_length = rand() % 255 + 1; // 1-255 bytes
-    uint8_t packet[packet_length];
+    uint8_t packet[MAX_NET_PACKET_LENGTH];
     // Initialise packet to send
     for (uint16_t byte_num = 0; byte_num < packet_length; byte_num++) {
         // packet[byte_num] = rand() % 0x100; // All possible values
@@ -56,7 +98,11 @@ bool dll_test(DLL& dll) {
         put_str("Sending packet:  "); print(packet, packet_length);
     #endif
     // Send packet
-    dll.send(packet, packet_length, 0xFF);
+    #ifdef DLL_DEDUP
+        uint8_t sequence = dll.send(packet, packet_length, 0xFF);
+    #else
+        dll.send(packet, packet_length, 0xFF);
+    #endif
     #ifdef DEBUG_DLL_TEST
         put_str("Received packet: "); print(dll.received_packet, dll.received_packet_length);
         #ifdef DEBUG_DLL
@@ -82,6 +128,54 @@ bool dll_test(DLL& dll) {
     #endif
     // Deallocate received packet
     deallocate(dll.received_packet, dll.received_packet_length);
+    #ifdef DLL_DEDUP
+        // Check a retransmission of the packet is not delivered again
+        uint16_t duplicates = dll.drop_count(DROP_DUPLICATE);
+        dll.resend(packet, packet_length, 0xFF, sequence);
+        if (dll.received_packet != NULL or dll.drop_count(DROP_DUPLICATE) == duplicates) {
+            put_str("Error: Duplicate packet delivered\r\n");
+            return 1;
+        }
+        // Check the same sequence number is delivered again after a restart
+        dll.announce_restart();
+        dll.resend(packet, packet_length, 0xFF, sequence);
+        if (dll.received_packet == NULL) {
+            put_str("Error: Packet after restart dropped as duplicate\r\n");
+            return 1;
+        }
+        deallocate(dll.received_packet, dll.received_packet_length);
+    #endif
+    #ifdef DLL_LINK_QUALITY
+        // Check a retransmission fills in a frame lost from a split packet
+        dll.lose_frame = 1;
+        uint8_t lost_sequence = dll.send(packet, packet_length, 0xFF);
+        if (dll.lose_frame != 0) {
+            // Sent in one frame, nothing to lose
+            dll.lose_frame = 0;
+            deallocate(dll.received_packet, dll.received_packet_length);
+        } else {
+            if (dll.received_packet != NULL) {
+                put_str("Error: Split packet delivered with a frame lost\r\n");
+                return 1;
+            }
+            dll.resend(packet, packet_length, 0xFF, lost_sequence);
+            if (dll.received_packet_length != packet_length or memcmp(dll.received_packet, packet, packet_length) != 0) {
+                put_str("Error: Lost frame not filled in by retransmission\r\n");
+                return 1;
+            }
+            deallocate(dll.received_packet, dll.received_packet_length);
+            // Check a split packet still missing a frame is given up on
+            uint16_t timeouts = dll.drop_count(DROP_TIMEOUT);
+            dll.lose_frame = 1;
+            dll.send(packet, packet_length, 0xFF);
+            dll.reconstructed_time -= dll.reassembly_timeout() + 1;
+            dll.poll();
+            if (dll.reconstructed_packet != NULL or dll.drop_count(DROP_TIMEOUT) != timeouts + 1) {
+                put_str("Error: Split packet missing a frame not timed out\r\n");
+                return 1;
+            }
+        }
+    #endif
     // Check for no memory leaks
     if (mem_leak()) {
         put_str("Error: Memory leak\r\n");
@@ -3,7 +3,79 @@
 #include <string.h>
 #include "config.hpp"
 
-uint16_t mem_use;
+#ifdef HOST_TOOL
+    // DLLs on different threads share the count
+    #include <atomic>
+    std::atomic<uint16_t> mem_use;
+#else
+    uint16_t mem_use;
+#endif
+
+#ifdef DLL_STATIC
+    // Fixed blocks replace the heap, so all DLL memory is counted at link time.
+    // Frame blocks hold stuffed frames, their messages and NET packet parts,
+    // packet blocks hold whole packets being compressed or reassembled.
+    // NET replying from receive nests a send in the delivery, which takes 4
+    // frame and 3 packet blocks. The loopback test nests a receive in every send.
+    #ifndef MEM_FRAME_BLOCKS
+        #ifdef DLL_TEST
+            #define MEM_FRAME_BLOCKS 5
+        #else
+            #define MEM_FRAME_BLOCKS 4
+        #endif
+    #endif
+    #ifndef MEM_PACKET_BLOCKS
+        #ifdef DLL_TEST
+            #define MEM_PACKET_BLOCKS 4
+        #else
+            #define MEM_PACKET_BLOCKS 3
+        #endif
+    #endif
+
+    static uint8_t frame_blocks[MEM_FRAME_BLOCKS][MAX_STUFFED_FRAME_LENGTH];
+    static uint8_t packet_blocks[MEM_PACKET_BLOCKS][MAX_NET_PACKET_LENGTH];
+    static bool frame_block_used[MEM_FRAME_BLOCKS];
+    static bool packet_block_used[MEM_PACKET_BLOCKS];
+
+    // Takes the smallest free block that fits, NULL if there is none
+    static uint8_t* take_block(uint8_t length) {
+        if (length <= MAX_STUFFED_FRAME_LENGTH) {
+            for (uint8_t i = 0; i < MEM_FRAME_BLOCKS; i++) {
+                if (frame_block_used[i] == false) {
+                    frame_block_used[i] = true;
+                    return frame_blocks[i];
+                }
+            }
+        }
+        for (uint8_t i = 0; i < MEM_PACKET_BLOCKS; i++) {
+            if (packet_block_used[i] == false) {
+                packet_block_used[i] = true;
+                return packet_blocks[i];
+            }
+        }
+        #ifdef DEBUG_MEM
+            put_str("Out of memory blocks\r\n");
+        #endif
+        return NULL;
+    }
+
+    // Returns the size of the block and frees it if asked
+    static uint8_t find_block(uint8_t* pointer, bool release) {
+        for (uint8_t i = 0; i < MEM_FRAME_BLOCKS; i++) {
+            if (pointer == frame_blocks[i]) {
+                frame_block_used[i] = frame_block_used[i] and not release;
+                return MAX_STUFFED_FRAME_LENGTH;
+            }
+        }
+        for (uint8_t i = 0; i < MEM_PACKET_BLOCKS; i++) {
+            if (pointer == packet_blocks[i]) {
+                packet_block_used[i] = packet_block_used[i] and not release;
+                return MAX_NET_PACKET_LENGTH;
+            }
+        }
+        return 0;
+    }
+#endif
 
 bool mem_leak() {
     if (mem_use != 0) {
@@ -14,15 +86,20 @@ bool mem_leak() {
 }
 
 void print_mem_use() {
-    if (mem_use >= 1024) {
-        put_uint16(mem_use/1024);  put_str(" KiB in use\r\n");
+    uint16_t bytes = mem_use;
+    if (bytes >= 1024) {
+        put_uint16(bytes/1024);  put_str(" KiB in use\r\n");
     } else {
-        put_uint16(mem_use); put_str(" B in use\r\n");
+        put_uint16(bytes); put_str(" B in use\r\n");
     }
 }
 
 void allocate(uint8_t*& pointer, uint8_t& length, uint8_t new_length) {
-    pointer = (uint8_t*) malloc(sizeof(*pointer) * new_length);
+    #ifdef DLL_STATIC
+        pointer = take_block(new_length);
+    #else
+        pointer = (uint8_t*) malloc(sizeof(*pointer) * new_length);
+    #endif
     if (pointer == NULL) {
         #ifdef DEBUG_MEM
             put_str("Failed to allocate\r\n");
@@ -39,16 +116,28 @@ void allocate(uint8_t*& pointer, uint8_t& length, uint8_t new_length) {
 }
 
 void reallocate(uint8_t*& pointer, uint8_t& length, uint8_t new_length) {
-    uint8_t temp[new_length];
-    memcpy(temp, pointer, new_length);
-    pointer = (uint8_t*) malloc(sizeof(*pointer) * new_length);
-    memcpy(pointer, temp, new_length);
-    if (pointer == NULL) {
+    uint8_t* moved = pointer;
+    #ifdef DLL_STATIC
+        // Grow in place while the block has room, otherwise move to a larger one
+        if (pointer == NULL or new_length > find_block(pointer, false)) {
+            moved = take_block(new_length);
+            if (moved != NULL and pointer != NULL) {
+                memcpy(moved, pointer, length < new_length ? length : new_length);
+                find_block(pointer, true);
+            }
+        }
+    #else
+        moved = (uint8_t*) realloc(pointer, sizeof(*pointer) * new_length);
+    #endif
+    if (moved == NULL) {
         #ifdef DEBUG_MEM
             put_str("Failed to reallocate\r\n");
         #endif
+        // Free the old memory too, callers only need to check for NULL
+        deallocate(pointer, length);
         return;
     }
+    pointer = moved;
     int8_t num_bytes = sizeof(*pointer) * (new_length - length);
     mem_use += num_bytes;
     #ifdef DEBUG_MEM_ELABORATE
@@ -73,7 +162,11 @@ void deallocate(uint8_t*& pointer, uint8_t& length) {
         length = 0;
         return;
     }
-    free(pointer);
+    #ifdef DLL_STATIC
+        find_block(pointer, true);
+    #else
+        free(pointer);
+    #endif
     uint8_t num_bytes = sizeof(*pointer) * length;
     mem_use -= num_bytes;
     #ifdef DEBUG_MEM_ELABORATE
@@ -4,6 +4,7 @@
 bool mem_leak();
 void print_mem_use();
 
+// pointer is NULL if there is no memory left, reallocate() then frees the old memory
 void allocate(uint8_t*& pointer, uint8_t& length, uint8_t new_length);
 void reallocate(uint8_t*& pointer, uint8_t& length, uint8_t new_length);
 void deallocate(uint8_t*& pointer, uint8_t& length);
\ No newline at end of file
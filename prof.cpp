@@ -0,0 +1,94 @@
+#include "prof.hpp"
+
+#ifdef DLL_PROFILE
+
+Profile profiles[NUM_PROFILE_STAGES];
+uint32_t profile_overhead;
+uint32_t profile_spent;
+
+const char* profile_names[NUM_PROFILE_STAGES] = {
+    "send      ",
+    "receive   ",
+    "crc       ",
+    "stuff     ",
+    "destuff   ",
+    "reassembly",
+};
+
+void init_profile() {
+    init_timer1();
+    // Measure the cost of an empty start/stop pair so it can be subtracted
+    uint32_t start = get_cycles();
+    profile_overhead = get_cycles() - start;
+    profile_spent = 0;
+    reset_profile();
+}
+
+void reset_profile() {
+    for (uint8_t stage = 0; stage < NUM_PROFILE_STAGES; stage++) {
+        profiles[stage].count = 0;
+        profiles[stage].total = 0;
+        profiles[stage].min = 0xFFFFFFFF;
+        profiles[stage].max = 0;
+        for (uint8_t bucket = 0; bucket < NUM_PROFILE_BUCKETS; bucket++) {
+            profiles[stage].histogram[bucket] = 0;
+        }
+    }
+}
+
+void profile(uint8_t stage, uint32_t start) {
+    uint32_t entry = get_cycles();
+    uint32_t cycles = entry - profile_spent - start;
+    if (cycles > profile_overhead) {
+        cycles -= profile_overhead;
+    } else {
+        cycles = 0;
+    }
+    Profile& p = profiles[stage];
+    p.count++;
+    p.total += cycles;
+    if (cycles < p.min) {
+        p.min = cycles;
+    }
+    if (cycles > p.max) {
+        p.max = cycles;
+    }
+    uint8_t bucket = 0;
+    for (uint32_t bound = 256; cycles >= bound and bucket < NUM_PROFILE_BUCKETS - 1; bound <<= 1) {
+        bucket++;
+    }
+    p.histogram[bucket]++;
+    profile_spent += get_cycles() - entry;
+}
+
+// Values above 16 bits are printed in units of 1024
+void print_count(uint32_t count) {
+    if (count > 0xFFFF) {
+        put_uint16(count >> 10); put_ch('K');
+    } else {
+        put_uint16(count);
+    }
+}
+
+void print_profile() {
+    put_str("Stage       Count   Min     Avg     Max     (cycles)\r\n");
+    for (uint8_t stage = 0; stage < NUM_PROFILE_STAGES; stage++) {
+        Profile& p = profiles[stage];
+        if (p.count == 0) {
+            continue;
+        }
+        put_str(profile_names[stage]); put_str("  ");
+        print_count(p.count); put_ch('\t');
+        print_count(p.min); put_ch('\t');
+        print_count(p.total / p.count); put_ch('\t');
+        print_count(p.max); put_str("\r\n");
+        put_str("  histogram:");
+        for (uint8_t bucket = 0; bucket < NUM_PROFILE_BUCKETS; bucket++) {
+            put_ch(' '); print_count(p.histogram[bucket]);
+        }
+        put_str("\r\n");
+    }
+    put_str("Histogram buckets: <256, <512, <1K, <2K, <4K, <8K, <16K, >=16K cycles\r\n");
+    put_str("Send and receive include the stages nested in them\r\n");
+}
+#endif
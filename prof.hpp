@@ -0,0 +1,40 @@
+#pragma once
+#include <stdint.h>
+#include "config.hpp"
+#include "timer.hpp"
+
+// Profiled DLL stages
+#define PROFILE_SEND       0 // frame construction through byte stuffing, includes crc and stuff
+#define PROFILE_RECEIVE    1 // whole of DLL::receive, includes destuff, crc and reassembly
+#define PROFILE_CRC        2
+#define PROFILE_STUFF      3
+#define PROFILE_DESTUFF    4
+#define PROFILE_REASSEMBLY 5
+#define NUM_PROFILE_STAGES 6
+
+// Histogram bucket 0 is below 256 cycles, then one bucket per power of two
+#define NUM_PROFILE_BUCKETS 8
+
+struct Profile {
+    uint32_t count;
+    uint64_t total;
+    uint32_t min;
+    uint32_t max;
+    uint32_t histogram[NUM_PROFILE_BUCKETS];
+};
+
+void init_profile();
+void reset_profile();
+void print_profile();
+void profile(uint8_t stage, uint32_t start);
+
+#ifdef DLL_PROFILE
+    // Cycles spent inside profile(), left out of the stages it interrupts so
+    // outer stages only include the nested stages' own work
+    extern uint32_t profile_spent;
+    #define PROFILE_START(start) uint32_t start = get_cycles() - profile_spent
+    #define PROFILE_STOP(stage, start) profile(stage, start)
+#else
+    #define PROFILE_START(start)
+    #define PROFILE_STOP(stage, start)
+#endif
@@ -0,0 +1,435 @@
+// Host tool: discrete-event simulation of many DLL nodes on a shared bus
+//
+// Usage: sim [options]
+//   -n nodes     number of nodes, addressed 0 to n-1 (8)
+//   -b baud      bus rate (9600)
+//   -d delay     end to end propagation delay in microseconds (5)
+//   -e ber       independent bit error rate (0)
+//   -g p,q,ber   Gilbert-Elliott burst errors: chance per bit of going from the
+//                good to the bad state (p) and back (q), and the bad state ber
+//   -l load      packets per second generated by each node (1)
+//   -s size      largest packet in bytes, 4 to 255 (64)
+//   -B fraction  fraction of packets that are broadcast (0)
+//   -R fraction  fraction of packets the sender retransmits, as if its
+//                acknowledgement were lost (0)
+//   -t seconds   simulated time (60)
+//   -r seed      random seed (1)
+//
+// Every node runs a real DLL. Sent frames contend for the bus with the same
+// carrier sense and backoff rules as mac.cpp, overlapping transmissions
+// collide, and each receiver sees the frame through its own channel error
+// model. Packets carry their id in the first 4 bytes so deliveries can be
+// checked and timed.
+#include "dll.hpp"
+#include "framer.hpp"
+#include "mac.hpp"
+#include "timer.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <queue>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#define EVENT_GENERATE 0
+#define EVENT_ATTEMPT  1
+#define EVENT_TX_END   2
+#define EVENT_RX       3
+
+struct Event {
+    uint64_t time; // ns
+    uint64_t sequence; // keeps same time events in order
+    uint8_t type;
+    uint16_t node;
+    uint32_t transmission;
+    bool operator>(const Event& other) const {
+        return time != other.time ? time > other.time : sequence > other.sequence;
+    }
+};
+
+struct Transmission {
+    uint32_t id;
+    uint16_t node;
+    uint64_t start;
+    uint64_t end;
+    bool collided;
+};
+
+struct Packet {
+    uint8_t source;
+    uint8_t destination;
+    uint64_t created;
+    std::vector<uint8_t> data;
+};
+
+// Options
+uint16_t num_nodes = 8;
+uint32_t baud = 9600;
+uint64_t delay = 5000;
+double ber = 0;
+bool burst_errors = false;
+double burst_p = 0, burst_q = 0, burst_ber = 0;
+double load = 1;
+uint8_t max_size = 64;
+double broadcast_fraction = 0;
+double retransmit_fraction = 0;
+double duration = 60;
+unsigned seed = 1;
+
+// Simulation state
+uint64_t now;
+uint64_t next_sequence;
+std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+std::mt19937_64 random_engine;
+std::vector<Transmission> active;
+std::unordered_map<uint32_t, std::pair<std::vector<uint8_t>, uint16_t>> frames_in_flight;
+uint32_t next_transmission;
+uint64_t last_bus_end;
+bool bus_used; // last_bus_end is only meaningful once a transmission has ended
+uint64_t bus_busy_time;
+uint64_t bit_time, char_time, idle_time, slot_time;
+std::vector<Packet> packets;
+bool generating = true;
+
+// Results
+uint64_t expected_deliveries, deliveries, delivered_bytes;
+uint64_t corrupted_deliveries, duplicate_deliveries;
+uint64_t collisions, mac_drops;
+std::vector<uint64_t> latencies;
+std::vector<std::vector<bool>> delivered; // [packet][node]
+
+// Simulated time stands in for Timer1, so DLL timeouts follow the simulation
+void init_timer1() {}
+
+uint32_t get_cycles() {
+    return now * 12 / 1000;
+}
+
+void schedule(uint64_t time, uint8_t type, uint16_t node, uint32_t transmission = 0) {
+    events.push(Event{time, next_sequence++, type, node, transmission});
+}
+
+double uniform() {
+    return std::uniform_real_distribution<double>(0, 1)(random_engine);
+}
+
+class Node : public PHY, public NET {
+public:
+    uint16_t index;
+    DLL dll;
+    Framer framer;
+    std::deque<std::vector<uint8_t>> queue;
+    bool contending;
+    uint8_t attempts;
+    int16_t deferral; // extra idle times for the current attempt, -1 before it starts listening
+    uint64_t listen_start; // when the current attempt started listening
+    bool bad_state;
+
+    Node(uint16_t index) : index(index), dll(index), contending(false), attempts(0), deferral(-1), listen_start(0),
+                           bad_state(false) {
+        dll.connect(this, this);
+    }
+
+    void send(uint8_t* frame, uint8_t frame_length) {
+        queue.push_back(std::vector<uint8_t>(frame, frame + frame_length));
+        if (not contending) {
+            contending = true;
+            schedule(now, EVENT_ATTEMPT, index);
+        }
+    }
+
+    void receive(uint8_t* packet, uint8_t packet_length, uint8_t source_address) {
+        uint32_t id = 0;
+        if (packet_length >= 4) {
+            memcpy(&id, packet, 4);
+        }
+        if (packet_length < 4 or id >= packets.size()
+            or packets[id].data.size() != packet_length
+            or memcmp(packets[id].data.data(), packet, packet_length) != 0) {
+            corrupted_deliveries++;
+            return;
+        }
+        if (delivered[id][index]) {
+            duplicate_deliveries++;
+            return;
+        }
+        delivered[id][index] = true;
+        deliveries++;
+        delivered_bytes += packet_length;
+        latencies.push_back(now - packets[id].created);
+    }
+
+    // Passes a received byte through this receiver's channel
+    uint8_t corrupt(uint8_t byte) {
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            double error_rate = ber;
+            if (burst_errors) {
+                if (bad_state) {
+                    bad_state = uniform() >= burst_q;
+                } else {
+                    bad_state = uniform() < burst_p;
+                }
+                if (bad_state) {
+                    error_rate = burst_ber;
+                }
+            }
+            if (error_rate > 0 and uniform() < error_rate) {
+                byte ^= 1 << bit;
+            }
+        }
+        return byte;
+    }
+};
+
+std::vector<Node*> nodes;
+
+void generate(Node& node) {
+    if (not generating) {
+        return;
+    }
+    Packet packet;
+    packet.source = node.index;
+    if (uniform() < broadcast_fraction) {
+        packet.destination = 0xFF;
+    } else {
+        packet.destination = (node.index + 1 + random_engine() % (num_nodes - 1)) % num_nodes;
+    }
+    packet.created = now;
+    uint8_t length = 4 + random_engine() % (max_size - 3);
+    uint32_t id = packets.size();
+    packet.data.resize(length);
+    memcpy(packet.data.data(), &id, 4);
+    for (uint8_t i = 4; i < length; i++) {
+        packet.data[i] = random_engine();
+    }
+    packets.push_back(packet);
+    delivered.push_back(std::vector<bool>(num_nodes, false));
+    expected_deliveries += packet.destination == 0xFF ? num_nodes - 1 : 1;
+    uint8_t sequence = node.dll.send(packets[id].data.data(), length, packet.destination);
+    if (uniform() < retransmit_fraction) {
+        node.dll.resend(packets[id].data.data(), length, packet.destination, sequence);
+    }
+    // Poisson arrivals
+    double gap = std::exponential_distribution<double>(load)(random_engine);
+    schedule(now + (uint64_t) (gap * 1e9), EVENT_GENERATE, node.index);
+}
+
+// Carrier sense, then start transmitting the frame at the head of the queue
+void attempt(Node& node) {
+    // Like wait_idle(), silence counts from when the attempt starts listening
+    // and lasts a random number of extra idle times
+    if (node.deferral < 0) {
+        node.deferral = defer_slots();
+        node.listen_start = now;
+    }
+    uint64_t quiet_since = node.listen_start;
+    if (bus_used) {
+        quiet_since = std::max(quiet_since, last_bus_end + delay);
+    }
+    for (Transmission& t : active) {
+        if (t.start + delay <= now) {
+            quiet_since = std::max(quiet_since, t.end + delay);
+        }
+    }
+    // Earliest time this node sees the bus idle for long enough
+    uint64_t idle_from = quiet_since + (1 + node.deferral) * idle_time;
+    if (idle_from > now) {
+        schedule(idle_from, EVENT_ATTEMPT, node.index);
+        return;
+    }
+    node.deferral = -1;
+    Transmission transmission;
+    transmission.id = next_transmission++;
+    transmission.node = node.index;
+    transmission.start = now;
+    transmission.end = now + node.queue.front().size() * char_time;
+    transmission.collided = false;
+    // Transmissions this node could not hear yet collide with it, both
+    // senders notice one character after the other signal reaches them
+    for (Transmission& other : active) {
+        transmission.collided = true;
+        transmission.end = std::min(transmission.end, std::max(now, other.start + delay) + char_time);
+        if (not other.collided or now + delay + char_time < other.end) {
+            other.collided = true;
+            other.end = std::min(other.end, now + delay + char_time);
+            schedule(other.end, EVENT_TX_END, other.node, other.id);
+        }
+    }
+    active.push_back(transmission);
+    schedule(transmission.end, EVENT_TX_END, node.index, transmission.id);
+}
+
+void transmission_end(Node& node, uint32_t id) {
+    std::vector<Transmission>::iterator t = std::find_if(active.begin(), active.end(),
+        [id](const Transmission& t) { return t.id == id; });
+    // Stale event for a transmission cut short by a collision
+    if (t == active.end() or t->end != now) {
+        return;
+    }
+    Transmission transmission = *t;
+    active.erase(t);
+    bus_busy_time += transmission.end - transmission.start;
+    last_bus_end = std::max(last_bus_end, transmission.end);
+    bus_used = true;
+    if (transmission.collided) {
+        collisions++;
+        node.attempts++;
+        if (node.attempts < MAC_MAX_ATTEMPTS) {
+            schedule(now + backoff_slots(node.attempts) * slot_time, EVENT_ATTEMPT, node.index);
+            return;
+        }
+        mac_drops++;
+    } else {
+        frames_in_flight[id] = std::make_pair(node.queue.front(), num_nodes - 1);
+        for (Node* receiver : nodes) {
+            if (receiver != &node) {
+                schedule(now + delay, EVENT_RX, receiver->index, id);
+            }
+        }
+    }
+    node.queue.pop_front();
+    node.attempts = 0;
+    if (node.queue.empty()) {
+        node.contending = false;
+    } else {
+        schedule(now, EVENT_ATTEMPT, node.index);
+    }
+}
+
+void receive(Node& node, uint32_t id) {
+    std::pair<std::vector<uint8_t>, uint16_t>& in_flight = frames_in_flight[id];
+    for (uint8_t byte : in_flight.first) {
+        if (node.framer.push(node.corrupt(byte))) {
+            node.dll.receive(node.framer.frame, node.framer.frame_length);
+        }
+    }
+    if (--in_flight.second == 0) {
+        frames_in_flight.erase(id);
+    }
+}
+
+bool parse_options(int argc, char* argv[]) {
+    int option;
+    while ((option = getopt(argc, argv, "n:b:d:e:g:l:s:B:R:t:r:")) != -1) {
+        switch (option) {
+            case 'n': num_nodes = atoi(optarg); break;
+            case 'b': baud = atoi(optarg); break;
+            case 'd': delay = atof(optarg) * 1000; break;
+            case 'e': ber = atof(optarg); break;
+            case 'g':
+                burst_errors = sscanf(optarg, "%lf,%lf,%lf", &burst_p, &burst_q, &burst_ber) == 3;
+                if (not burst_errors) {
+                    return false;
+                }
+                break;
+            case 'l': load = atof(optarg); break;
+            case 's': {
+                // Parsed wide so sizes past 255 are rejected, not wrapped
+                int size = atoi(optarg);
+                if (size < 4 or size > 255) {
+                    return false;
+                }
+                max_size = size;
+                break;
+            }
+            case 'B': broadcast_fraction = atof(optarg); break;
+            case 'R': retransmit_fraction = atof(optarg); break;
+            case 't': duration = atof(optarg); break;
+            case 'r': seed = atoi(optarg); break;
+            default: return false;
+        }
+    }
+    return num_nodes >= 2 and num_nodes <= 254 and baud > 0 and load > 0 and duration > 0;
+}
+
+double percentile(double fraction) {
+    if (latencies.empty()) {
+        return 0;
+    }
+    return latencies[(size_t) (fraction * (latencies.size() - 1))] / 1e6;
+}
+
+int main(int argc, char* argv[]) {
+    if (not parse_options(argc, argv)) {
+        fprintf(stderr, "Usage: %s [-n nodes] [-b baud] [-d delay_us] [-e ber] [-g p,q,ber] "
+                        "[-l load] [-s size] [-B fraction] [-R fraction] [-t seconds] [-r seed]\n", argv[0]);
+        return 1;
+    }
+    random_engine.seed(seed);
+    srand(seed); // backoff_slots() and defer_slots() use rand()
+    bit_time = 1000000000ULL / baud;
+    char_time = 10 * bit_time; // 8N1
+    idle_time = MAC_IDLE_BITS * bit_time;
+    slot_time = MAC_SLOT_BITS * bit_time;
+
+    for (uint16_t i = 0; i < num_nodes; i++) {
+        nodes.push_back(new Node(i));
+    }
+    #ifdef DLL_DEDUP
+        // Every node starts by telling the others its sequence numbers are new
+        for (Node* node : nodes) {
+            node->dll.announce_restart();
+        }
+    #endif
+    for (Node* node : nodes) {
+        double gap = std::exponential_distribution<double>(load)(random_engine);
+        schedule((uint64_t) (gap * 1e9), EVENT_GENERATE, node->index);
+    }
+    uint64_t end = duration * 1e9;
+    // Stop generating at the end and let queued frames drain for as long again
+    while (not events.empty() and events.top().time < 2 * end) {
+        Event event = events.top();
+        events.pop();
+        now = event.time;
+        if (generating and now >= end) {
+            generating = false;
+        }
+        Node& node = *nodes[event.node];
+        switch (event.type) {
+            case EVENT_GENERATE: generate(node); break;
+            case EVENT_ATTEMPT: attempt(node); break;
+            case EVENT_TX_END: transmission_end(node, event.transmission); break;
+            case EVENT_RX: receive(node, event.transmission); break;
+        }
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    uint32_t framing_errors = 0;
+    uint32_t drops[NUM_DROP_REASONS] = {0};
+    for (Node* node : nodes) {
+        framing_errors += node->framer.errors;
+        for (uint8_t reason = 0; reason < NUM_DROP_REASONS; reason++) {
+            drops[reason] += node->dll.drop_count(reason);
+        }
+    }
+    double line_rate = baud / 10.0; // bytes per second
+    printf("%u nodes, %u baud, %.1f us delay, %.0f s\n", num_nodes, baud, delay / 1e3, duration);
+    printf("Packets generated:    %zu\n", packets.size());
+    printf("Deliveries:           %lu of %lu (%.1f%%)\n", deliveries, expected_deliveries,
+           expected_deliveries ? 100.0 * deliveries / expected_deliveries : 0);
+    printf("Goodput:              %.1f B/s (%.1f%% of line rate)\n", delivered_bytes / duration,
+           100.0 * delivered_bytes / duration / line_rate);
+    printf("Bus utilisation:      %.1f%%\n", 100.0 * bus_busy_time / (now ? now : 1));
+    printf("Latency (ms):         p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+           percentile(0.5), percentile(0.9), percentile(0.99), percentile(1));
+    printf("Drop causes:\n");
+    printf("  Collisions:         %lu (%lu frames dropped after %u attempts)\n", collisions, mac_drops, MAC_MAX_ATTEMPTS);
+    printf("  Framing errors:     %u\n", framing_errors);
+    printf("  Format errors:      %u\n", drops[DROP_FORMAT]);
+    printf("  CRC errors:         %u\n", drops[DROP_CRC]);
+    printf("  Split packet drops: %u\n", drops[DROP_SPLIT]);
+    printf("  Split packets lost: %u (frames missing)\n", drops[DROP_TIMEOUT]);
+    printf("  Decompress errors:  %u\n", drops[DROP_DECOMPRESS]);
+    printf("  Out of memory:      %u\n", drops[DROP_MEMORY]);
+    printf("  Undetected errors:  %lu\n", corrupted_deliveries);
+    printf("  Duplicates:         %lu (%u duplicate frames dropped)\n", duplicate_deliveries, drops[DROP_DUPLICATE]);
+    printf("Frames for other nodes: %u\n", drops[DROP_ADDRESS]);
+    for (Node* node : nodes) {
+        delete node;
+    }
+    return 0;
+}
@@ -0,0 +1,51 @@
+#include "timer.hpp"
+#include "config.hpp"
+
+#ifdef WINDOWS
+    #include <chrono>
+
+    static std::chrono::steady_clock::time_point timer_start;
+
+    void init_timer1() {
+        timer_start = std::chrono::steady_clock::now();
+    }
+
+    // Host time scaled to ATmega644p cycles at 12 MHz
+    uint32_t get_cycles() {
+        std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - timer_start;
+        return (uint64_t) elapsed.count() * 12 / 1000;
+    }
+#else // AVR
+    #include <avr/io.h>
+    #include <avr/interrupt.h>
+
+    volatile uint16_t timer1_overflows;
+
+    ISR(TIMER1_OVF_vect) {
+        timer1_overflows++;
+    }
+
+    void init_timer1() {
+        // Normal mode, no prescaler: TCNT1 counts CPU cycles
+        TCCR1A = 0;
+        TCCR1B = _BV(CS10);
+        TCNT1 = 0;
+        timer1_overflows = 0;
+        TIMSK1 = _BV(TOIE1);
+        sei();
+    }
+
+    // 32-bit cycle count from TCNT1 and the overflow count
+    uint32_t get_cycles() {
+        uint8_t sreg = SREG;
+        cli();
+        uint16_t count = TCNT1;
+        uint16_t overflows = timer1_overflows;
+        // Overflow happened after interrupts were disabled
+        if ((TIFR1 & _BV(TOV1)) and count < 0x8000) {
+            overflows++;
+        }
+        SREG = sreg;
+        return ((uint32_t) overflows << 16) | count;
+    }
+#endif
@@ -0,0 +1,7 @@
+#pragma once
+#include <stdint.h>
+
+#define CYCLES_PER_MS 12000UL // get_cycles() counts the 12 MHz CPU clock
+
+void init_timer1();
+uint32_t get_cycles();
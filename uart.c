@@ -8,6 +8,68 @@ void init_uart0(void) {
 	UBRR0L = (F_CPU/(baud_rate*16L)-1);
 	UCSR0B = _BV(RXEN0) | _BV(TXEN0);
 	UCSR0C = _BV(UCSZ00) | _BV(UCSZ01);
+	#ifdef DLL_CSMA
+		RS485_DE_DDR |= _BV(RS485_DE);
+		RS485_DE_PORT &= ~_BV(RS485_DE);
+	#endif
+}
+
+static uint8_t tx_pending;
+
+/* UBRR and U2X settings indexed by DLL rate, all within 0.2% at 12 MHz */
+static const struct {
+	uint16_t ubrr;
+	uint8_t double_speed;
+} uart_rates[NUM_RATES] = {
+	{77, 0}, /* 9600 */
+	{38, 0}, /* 19200 */
+	{38, 1}, /* 38400 */
+	{25, 1}, /* 57600 */
+	{12, 1}, /* 115200 */
+	{2,  0}, /* 250000 */
+	{2,  1}, /* 500000 */
+	{0,  0}, /* 750000 */
+};
+
+void set_uart0_rate(uint8_t rate) {
+	/* Let the last frame finish sending at the old rate */
+	if (tx_pending) {
+		while (!(UCSR0A & _BV(TXC0)));
+		tx_pending = 0;
+	}
+	if (uart_rates[rate].double_speed) {
+		UCSR0A |= _BV(U2X0);
+	} else {
+		UCSR0A &= ~_BV(U2X0);
+	}
+	UBRR0H = uart_rates[rate].ubrr >> 8;
+	UBRR0L = uart_rates[rate].ubrr;
+}
+
+uint8_t uart0_received(void) {
+	return UCSR0A & _BV(RXC0);
+}
+
+/* CPU cycles per bit at the current rate */
+uint16_t uart0_bit_cycles(void) {
+	uint16_t ubrr = ((uint16_t) UBRR0H << 8) | UBRR0L;
+	if (UCSR0A & _BV(U2X0)) {
+		return 8 * (ubrr + 1);
+	}
+	return 16 * (ubrr + 1);
+}
+
+/* Enables the RS-485 driver, disabling waits for the last byte to leave */
+void uart0_driver(uint8_t enable) {
+	if (enable) {
+		RS485_DE_PORT |= _BV(RS485_DE);
+	} else {
+		if (tx_pending) {
+			while (!(UCSR0A & _BV(TXC0)));
+			tx_pending = 0;
+		}
+		RS485_DE_PORT &= ~_BV(RS485_DE);
+	}
 }
 
 char get_ch(void) {
@@ -17,6 +79,8 @@ char get_ch(void) {
 
 void put_ch(char ch) {
 	while (!(UCSR0A & _BV(UDRE0)));
+	UCSR0A |= _BV(TXC0);
+	tx_pending = 1;
 	UDR0 = ch;
 }
 
@@ -8,8 +8,17 @@
 #define UART_H
 #define F_CPU 12000000
 
+//rs485 driver enable
+#define RS485_DE_DDR DDRD
+#define RS485_DE_PORT PORTD
+#define RS485_DE PD4
+
 //uart
 void init_uart0(void);
+void set_uart0_rate(uint8_t rate);
+uint8_t uart0_received(void);
+uint16_t uart0_bit_cycles(void);
+void uart0_driver(uint8_t enable);
 char get_ch(void);
 void put_ch(char ch);
 void put_str(const char* str);